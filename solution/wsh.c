@@ -1,12 +1,157 @@
 #include "./wsh.h"
 
 #define DEFAULT_HISTORY_SIZE 5
+#define MAX_HISTORY_SIZE (1 << 20)  //bounds history set and state files
 #define MAX_CMD_SIZE 128
+#define WSH_TIMEOUT_STATUS 124      //status of a command killed by timeout/deadline
+#define TIMEOUT_KILL_GRACE_MS 2000  //SIGTERM to SIGKILL escalation delay
+#define CACHE_MAGIC 0x43485357u     //"WSHC"
+#define CACHE_DEFAULT_MAX_BYTES (64LL * 1024 * 1024)
+#define EXEC_CACHE_BUCKETS 256
+#define LOOKAHEAD_LINES 32          //how far the batch lookahead thread runs ahead
+#define TEE_BUFFER_SIZE (1 << 20)   //read/write fallback of the tee builtin
+#define LINE_READER_SIZE 65536      //initial buffer of a LineReader
+#define STATE_MAGIC 0x53485357u     //"WSHS"
+#define STATE_VERSION 1
+#define READ_MAX_FD 10              //fds the read builtin keeps a buffered reader for
+#define ARITH_CACHE_BUCKETS 64      //compiled $((...)) expressions
+#define MAX_ARG_STRLEN (32 * 4096) //longest single argument or variable execve takes
+#define MAX_PARALLEL_JOBS 1024      //upper bound for -j, each job holds a pidfd and two pipes
 
 //Globals
 static ShellVariable *g_shell_vars_head = NULL; //head of shell vars linked list
 static History g_history = {.commands = NULL, .count = 0, .start = 0}; //stores recent command history
 int g_status = 0;
+static long long g_deadline_ms = 0;  //script deadline on the monotonic clock, 0 if none
+static int g_cmd_timeout_ms = -1;    //set by the timeout builtin for the next external command
+static long g_cache_hits = 0;        //cached builtin statistics for this session
+static long g_cache_misses = 0;
+static ExecCacheEntry *g_exec_cache[EXEC_CACHE_BUCKETS]; //resolved executables
+static char *g_exec_cache_path = NULL;  //PATH the executable cache was filled under
+static unsigned g_exec_cache_gen = 0;   //bumped whenever the cache is reset
+static pthread_mutex_t g_exec_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Lookahead g_lookahead = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+static StateSnapshot g_snapshot = {.base = NULL};  //state mapped by --load-state
+static char *g_state_save_path = NULL;              //written on exit by --save-state
+static Topology g_topology = {.loaded = 0};         //cpu/node layout, read on first placement
+static cpu_set_t *g_pin_cpus = NULL;                //set by the pin builtin for the next external command
+static FILE *g_input_stream = NULL;                 //where run_loop reads commands from
+static ReadBuffer g_read_buffers[READ_MAX_FD];      //read builtin readers, kept across invocations
+static ArithExpr *g_arith_cache[ARITH_CACHE_BUCKETS];  //compiled $((...)) by source text
+
+//Allocation accounting
+#ifdef WSH_MEMSTATS
+static long g_mem_live_bytes[MEM_SUBSYSTEMS];  //updated atomically, the lookahead thread allocates too
+static long g_mem_live_allocs[MEM_SUBSYSTEMS];
+static long g_mem_total_allocs[MEM_SUBSYSTEMS];
+static __thread MemSubsystem g_mem_subsystem = MEM_SHELL; //owner of new allocations
+
+//the real allocator is reached through (name), which the macros do not match
+static void mem_count(MemSubsystem subsystem, long bytes, long allocs){
+    __atomic_add_fetch(&g_mem_live_bytes[subsystem], bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_mem_live_allocs[subsystem], allocs, __ATOMIC_RELAXED);
+    if (allocs > 0) {
+        __atomic_add_fetch(&g_mem_total_allocs[subsystem], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *wsh_malloc(size_t size){
+    MemHeader *header = (malloc)(sizeof(MemHeader) + size);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->info.size = size;
+    header->info.subsystem = g_mem_subsystem;
+    mem_count(g_mem_subsystem, (long)size, 1);
+    return header + 1;
+}
+
+static void *wsh_calloc(size_t count, size_t size){
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = wsh_malloc(count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+static void wsh_free(void *ptr){
+    if (ptr == NULL) {
+        return;
+    }
+    MemHeader *header = (MemHeader *)ptr - 1;
+    mem_count(header->info.subsystem, -(long)header->info.size, -1);
+    (free)(header);
+}
+
+//a resized block stays with the subsystem that allocated it
+static void *wsh_realloc(void *ptr, size_t size){
+    if (ptr == NULL) {
+        return wsh_malloc(size);
+    }
+    MemHeader *header = (MemHeader *)ptr - 1;
+    MemSubsystem subsystem = header->info.subsystem;
+    size_t old_size = header->info.size;
+    header = (realloc)(header, sizeof(MemHeader) + size);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->info.size = size;
+    mem_count(subsystem, (long)size - (long)old_size, 0);
+    return header + 1;
+}
+
+static char *wsh_copy(const char *s, size_t len){
+    char *copy = wsh_malloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static char *wsh_strndup(const char *s, size_t n){
+    return wsh_copy(s, strnlen(s, n));
+}
+
+static char *wsh_strdup(const char *s){
+    return wsh_copy(s, strlen(s));
+}
+
+//libc's getline grows its buffer with the real allocator, so read into a
+//private buffer and hand out a tracked copy
+static ssize_t wsh_getline(char **lineptr, size_t *n, FILE *stream){
+    static __thread char *raw = NULL;
+    static __thread size_t raw_cap = 0;
+    ssize_t len = (getline)(&raw, &raw_cap, stream);
+    if (len == -1) {
+        return -1;
+    }
+    if (*lineptr == NULL || *n < (size_t)len + 1) {
+        char *grown = wsh_realloc(*lineptr, len + 1);
+        if (grown == NULL) {
+            return -1;
+        }
+        *lineptr = grown;
+        *n = len + 1;
+    }
+    memcpy(*lineptr, raw, len + 1);
+    return len;
+}
+
+//attributes allocations to subsystem until the matching mem_leave
+static MemSubsystem mem_enter(MemSubsystem subsystem){
+    MemSubsystem previous = g_mem_subsystem;
+    g_mem_subsystem = subsystem;
+    return previous;
+}
+
+static void mem_leave(MemSubsystem previous){
+    g_mem_subsystem = previous;
+}
+#endif
 
 //Helpers
 static int compare(const void *a, const void *b){
@@ -55,11 +200,23 @@ static char **parse_line(char *line, int *argc, Redirection *redir){
     redir->type = REDIR_NONE;
     redir->fd = STDOUT_FILENO;  //default is stdout
     redir->file = NULL;
+    redir->data = NULL;
+    redir->data_len = 0;
+    redir->invalid = 0;
 
     char *token;
+    char *expanded = NULL;
     *argc = 0;
     token = strtok(line, " ");
     while (token) {
+        //arithmetic expansion may span tokens and yields an ordinary word
+        free(expanded);
+        expanded = NULL;
+        if (strstr(token, "$((") != NULL) {
+            expanded = arith_expand_token(token);
+            token = expanded;
+        }
+
         //check for variable sub
         if (token[0] == '$') {
             char *name = token + 1;
@@ -85,31 +242,97 @@ static char **parse_line(char *line, int *argc, Redirection *redir){
         }else{//check redirection with file descriptor
             int fd = -1;
             char *redir_operator = NULL;
-            redir->type = get_redirection_type(token, &fd);
+            RedirectionType type = get_redirection_type(token, &fd);
+
+            //here-strings and here-documents may take their word from the next token
+            if (type == REDIR_HERESTRING || type == REDIR_HEREDOC) {
+                char *word = strstr(token, "<<") + (type == REDIR_HERESTRING ? 3 : 2);
+                if (*word == '\0') {
+                    word = strtok(NULL, " ");
+                }
+                if (word == NULL || *word == '\0') {
+                    fprintf(stderr, "wsh: syntax error near unexpected token '%s'\n", token);
+                    break;
+                }
+                //a pending here-document keeps its delimiter so run_loop still consumes the body
+                if (redir->type == REDIR_HEREDOC || (type == REDIR_HEREDOC && redir->type != REDIR_NONE)) {
+                    fprintf(stderr, "wsh: syntax error: a here-document cannot be combined with another redirection\n");
+                    redir->invalid = 1;
+                    if (redir->type == REDIR_HEREDOC) {
+                        token = strtok(NULL, " ");
+                        continue;
+                    }
+                }
+                free(redir->file);
+                free(redir->data);
+                redir->file = NULL;
+                redir->data = NULL;
+                redir->type = type;
+                redir->fd = (fd == -1) ? STDIN_FILENO : fd;
+                if (type == REDIR_HERESTRING) {
+                    char *value = word;
+                    if (word[0] == '$') {
+                        value = lookup_var(word + 1);
+                        value = value ? value : "";
+                    }
+                    redir->data_len = strlen(value) + 1;
+                    redir->data = malloc(redir->data_len + 1);
+                    if (redir->data == NULL) {
+                        perror("malloc");
+                        exit(1);
+                    }
+                    sprintf(redir->data, "%s\n", value);
+                } else {
+                    redir->file = strdup(word); //delimiter, run_loop reads the body
+                }
+                token = strtok(NULL, " ");
+                continue;
+            }
 
             //extract file
+            char *file = NULL;
             if ((redir_operator = strstr(token, ">>")) != NULL) {
-                redir->file = strdup(redir_operator + 2); 
+                file = redir_operator + 2;
             } else if ((redir_operator = strstr(token, ">")) != NULL) {
-                redir->file = strdup(redir_operator + 1); 
+                file = redir_operator + 1;
             } else if ((redir_operator = strstr(token, "&>>")) != NULL) {
-                redir->file = strdup(redir_operator + 3);
+                file = redir_operator + 3;
             } else if ((redir_operator = strstr(token, "&>")) != NULL) {
-                redir->file = strdup(redir_operator + 2); 
+                file = redir_operator + 2;
             } else if ((redir_operator = strstr(token, "<")) != NULL) {
-                redir->file = strdup(redir_operator + 1); 
+                file = redir_operator + 1;
             }
 
             if (redir_operator != NULL) {
-                if (redir->file == NULL || strlen(redir->file) == 0) {
+                if (strlen(file) == 0) {
                     fprintf(stderr, "wsh: syntax error near unexpected token '%s'\n", token);
                     break;
                 }
+                if (redir->type == REDIR_HEREDOC) {
+                    fprintf(stderr, "wsh: syntax error: a here-document cannot be combined with another redirection\n");
+                    redir->invalid = 1;
+                    token = strtok(NULL, " ");
+                    continue;
+                }
+                //a later redirection replaces an earlier one
+                free(redir->file);
+                free(redir->data);
+                redir->data = NULL;
+                redir->data_len = 0;
+                redir->file = strdup(file);
+                if (redir->file == NULL) {
+                    perror("strdup");
+                    exit(1);
+                }
+                redir->type = type;
                 if(redir->type == REDIR_INPUT){
                     redir->fd = (fd == -1) ? STDIN_FILENO : fd;
                 }else{
                     redir->fd = (fd == -1) ? STDOUT_FILENO : fd;
                 }
+                //the redirection is not an argument of the command
+                token = strtok(NULL, " ");
+                continue;
             }else{
                 tokens[*argc] = strdup(token);
                 if (tokens[*argc] == NULL) {
@@ -122,7 +345,7 @@ static char **parse_line(char *line, int *argc, Redirection *redir){
 
         (*argc)++;
         if(*argc >= buffer_size) {
-            buffer_size += MAX_CMD_SIZE;
+            buffer_size *= 2; //geometric growth keeps huge command lines linear
             tokens = realloc(tokens, buffer_size * sizeof(char*));
             if (!tokens) {
                 perror("realloc");
@@ -131,6 +354,7 @@ static char **parse_line(char *line, int *argc, Redirection *redir){
         }
         token = strtok(NULL, " ");
     }
+    free(expanded);
     tokens[*argc] = NULL;
     return tokens;
 }
@@ -159,6 +383,12 @@ static RedirectionType get_redirection_type(char *token, int *fd){
     if (strncmp(redir_pos, ">", 1) == 0) {
         return REDIR_OUTPUT;
     }
+    if (strncmp(redir_pos, "<<<", 3) == 0) {
+        return REDIR_HERESTRING;
+    }
+    if (strncmp(redir_pos, "<<", 2) == 0) {
+        return REDIR_HEREDOC;
+    }
     if (strncmp(redir_pos, "<", 1) == 0) {
         return REDIR_INPUT;
     }
@@ -167,9 +397,123 @@ static RedirectionType get_redirection_type(char *token, int *fd){
     return REDIR_NONE;
 }
 
+static int is_input_redirection(RedirectionType type){
+    return type == REDIR_INPUT || type == REDIR_HEREDOC || type == REDIR_HERESTRING;
+}
+
+//exported variables shadow shell variables, as in parse_line
+static char *lookup_var(const char *name){
+    char *value = getenv(name);
+    if (value == NULL) {
+        value = get_shell_var((char *)name);
+    }
+    return value;
+}
+
+static void buf_append(char **buf, size_t *len, size_t *cap, const char *data, size_t n){
+    if (*len + n + 1 > *cap) {
+        while (*len + n + 1 > *cap) {
+            *cap = *cap ? *cap * 2 : 256;
+        }
+        *buf = realloc(*buf, *cap);
+        if (*buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+//reads here-document lines up to the delimiter in redir->file; $NAME is
+//expanded unless the delimiter was quoted ('EOF' or "EOF")
+static void read_heredoc(FILE *input_stream, Redirection *redir){
+    char *delim = redir->file;
+    size_t delim_len = strlen(delim);
+    int expand = 1;
+    if (delim_len >= 2 && (delim[0] == '\'' || delim[0] == '"') && delim[delim_len - 1] == delim[0]) {
+        delim[delim_len - 1] = '\0';
+        memmove(delim, delim + 1, delim_len - 1);
+        expand = 0;
+    }
+
+    size_t cap = 0;
+    char *line;
+    while ((line = read_line(input_stream)) != NULL) {
+        lookahead_advance();
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, delim) == 0) {
+            free(line);
+            return;
+        }
+        char *p = line;
+        while (*p != '\0') {
+            char *dollar = expand ? strchr(p, '$') : NULL;
+            size_t name_len = dollar ? strspn(dollar + 1, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_") : 0;
+            if (dollar == NULL || name_len == 0) {
+                size_t n = dollar ? (size_t)(dollar - p) + 1 : strlen(p);
+                buf_append(&redir->data, &redir->data_len, &cap, p, n);
+                p += n;
+                continue;
+            }
+            buf_append(&redir->data, &redir->data_len, &cap, p, dollar - p);
+            char *name = strndup(dollar + 1, name_len);
+            if (name == NULL) {
+                perror("strndup");
+                exit(1);
+            }
+            char *value = lookup_var(name);
+            if (value != NULL) {
+                buf_append(&redir->data, &redir->data_len, &cap, value, strlen(value));
+            }
+            free(name);
+            p = dollar + 1 + name_len;
+        }
+        buf_append(&redir->data, &redir->data_len, &cap, "\n", 1);
+        free(line);
+    }
+    fprintf(stderr, "wsh: warning: here-document delimited by end-of-file (wanted '%s')\n", delim);
+}
+
+//stages here-document data for a child's stdin: small bodies go through a
+//pipe, larger ones into a sealed memfd, so nothing touches the filesystem
+static int heredoc_fd(const char *data, size_t len){
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+        if ((long)len <= fcntl(fds[1], F_GETPIPE_SZ)) {
+            struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+            writev_all(fds[1], &iov, 1); //fits in the pipe, never blocks
+            close(fds[1]);
+            return fds[0];
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int fd = memfd_create("wsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+    writev_all(fd, &iov, 1);
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static int open_input_redirection(Redirection *redir){
+    if (redir->type == REDIR_INPUT) {
+        return open(redir->file, O_RDONLY | O_CLOEXEC);
+    }
+    return heredoc_fd(redir->data ? redir->data : "", redir->data_len);
+}
+
 static void init_history(){
     g_history.commands = malloc(DEFAULT_HISTORY_SIZE * sizeof(char *));
-    if (g_history.commands == NULL) {
+    g_history.parsed = calloc(DEFAULT_HISTORY_SIZE, sizeof(ParsedCommand));
+    if (g_history.commands == NULL || g_history.parsed == NULL) {
         perror("malloc");
         exit(1);
     }
@@ -185,7 +529,8 @@ static int set_history_size(int new_size){
     }
 
     char **new_commands = malloc(new_size * sizeof(char *));
-    if (new_commands == NULL) {
+    ParsedCommand *new_parsed = calloc(new_size, sizeof(ParsedCommand));
+    if (new_commands == NULL || new_parsed == NULL) {
         perror("malloc");
         exit(1);
     }
@@ -198,16 +543,26 @@ static int set_history_size(int new_size){
         keep_count = new_size;
     }
 
+    //drop the oldest commands that no longer fit
+    for(int i = 0; i < g_history.count - keep_count; i++) {
+        int index = (g_history.start + i) % g_history.capacity;
+        snapshot_free(g_history.commands[index]);
+        free_parsed(&g_history.parsed[index]);
+    }
+
     //copy recent commands to new histoy list
     int curr_start_index = (g_history.start + g_history.count - keep_count) % g_history.capacity;
     for(int i = 0; i < keep_count; i++) {
         new_commands[i] = g_history.commands[(curr_start_index + i) % g_history.capacity];
+        new_parsed[i] = g_history.parsed[(curr_start_index + i) % g_history.capacity];
     }
 
     free(g_history.commands);
+    free(g_history.parsed);
 
     //update history
     g_history.commands = new_commands;
+    g_history.parsed = new_parsed;
     g_history.capacity = new_size;
     g_history.start = 0;
     g_history.count = keep_count;
@@ -222,6 +577,15 @@ static builtin_cmd_t get_builtin_command(char *cmd) {
     if (strcmp(cmd, "vars") == 0) return CMD_VARS;
     if (strcmp(cmd, "history") == 0) return CMD_HISTORY;
     if (strcmp(cmd, "ls") == 0) return CMD_LS;
+    if (strcmp(cmd, "multi") == 0) return CMD_MULTI;
+    if (strcmp(cmd, "timeout") == 0) return CMD_TIMEOUT;
+    if (strcmp(cmd, "cached") == 0) return CMD_CACHED;
+    if (strcmp(cmd, "tee") == 0) return CMD_TEE;
+    if (strcmp(cmd, "parallel") == 0) return CMD_PARALLEL;
+    if (strcmp(cmd, "pin") == 0) return CMD_PIN;
+    if (strcmp(cmd, "chunk") == 0) return CMD_CHUNK;
+    if (strcmp(cmd, "read") == 0) return CMD_READ;
+    if (strcmp(cmd, "memstats") == 0) return CMD_MEMSTATS;
     return NOT_BUILT_IN;
 }
 
@@ -236,7 +600,8 @@ static int add_to_history(char* command){
 
     //history is full, remove the oldest command
     if (g_history.count == g_history.capacity) {
-        free(g_history.commands[g_history.start]);
+        snapshot_free(g_history.commands[g_history.start]);
+        free_parsed(&g_history.parsed[g_history.start]);
         g_history.commands[g_history.start] = strdup(command);
         if (g_history.commands[g_history.start] == NULL) {
             perror("strdup");
@@ -256,18 +621,30 @@ static int add_to_history(char* command){
 }
 
 static int set_shell_var(char *name, char *value) {
+    return set_shell_var_n(name, value, strlen(value));
+}
+
+//sets a variable from the first len bytes of value, which need not be terminated
+static int set_shell_var_n(char *name, const char *value, size_t len) {
+    MemSubsystem previous = mem_enter(MEM_VARIABLES);
+    int status = store_shell_var(name, value, len);
+    mem_leave(previous);
+    return status;
+}
+
+static int store_shell_var(char *name, const char *value, size_t len) {
     ShellVariable *current = g_shell_vars_head;
 
     //check if the variable already exists in list
     while (current != NULL) {
         if (strcmp(current->name, name) == 0) {
             //update the value
-            char *new_value = strdup(value);
+            char *new_value = strndup(value, len);
             if (new_value == NULL) {
                 perror("strdup");
                 return -1;
             }
-            free(current->value);
+            snapshot_free(current->value);
             current->value = new_value;
             return 0;
         }
@@ -286,7 +663,7 @@ static int set_shell_var(char *name, char *value) {
         free(new_var);
         return -1;
     }
-    new_var->value = strdup(value);
+    new_var->value = strndup(value, len);
     if (new_var->value == NULL) {
         perror("strdup");
         free(new_var->name);
@@ -318,305 +695,3066 @@ static char* get_shell_var(char *name){
     return NULL;
 }
 
+static void free_parsed(ParsedCommand *parsed){
+    if (parsed->args == NULL) {
+        return;
+    }
+    for (int i = 0; i < parsed->argc; i++) {
+        free(parsed->args[i]);
+    }
+    free(parsed->args);
+    free(parsed->redir.file);
+    free(parsed->redir.data);
+    parsed->args = NULL;
+}
+
 static void free_history(){
     for(int i =0; i < g_history.count ; i++){
         int index = (g_history.start + i) % g_history.capacity;
-        free(g_history.commands[index]);
+        snapshot_free(g_history.commands[index]);
+        free_parsed(&g_history.parsed[index]);
     }
     free(g_history.commands);
+    free(g_history.parsed);
 }
 
-static void free_shell_vars(){
-    ShellVariable* current = g_shell_vars_head;
-    while (current != NULL) {
-        ShellVariable*temp = current;
-        current = current->next;
-        free(temp->name);
-        free(temp->value);
-        free(temp);
-    }
+//ring index of history entry command_num (1 is the most recent)
+static int history_index(int command_num){
+    return (g_history.start + g_history.count - command_num) % g_history.capacity;
 }
 
-//execute builtin commands
-int execute_vars(){
-    ShellVariable *current = g_shell_vars_head;
-    while (current != NULL) {
-        printf("%s=%s\n", current->name, current->value);
-        current = current->next;
+//parses a history entry once and keeps the result next to it. Builtins may
+//modify their args and $ tokens depend on current variables, so those are
+//parsed into scratch on every replay instead. Here-document bodies are not
+//kept in history, so such entries cannot be replayed.
+static ParsedCommand *history_parse(int command_num, ParsedCommand *scratch){
+    int index = history_index(command_num);
+    ParsedCommand *parsed = &g_history.parsed[index];
+    if (parsed->args != NULL) {
+        return parsed;
     }
-    return 0;
-}
 
-int execute_local(char **args, int argc){
-    if (argc != 2) {
-        fprintf(stderr, "local: usage: local VAR=value\n");
-        return -1;
+    char *command_str = strdup(g_history.commands[index]);
+    if (command_str == NULL) {
+        perror("strdup");
+        return NULL;
     }
-    char *arg = args[1];
-    char *equal_sign = strchr(arg, '=');
-    if(equal_sign == NULL) {
-        fprintf(stderr, "local: invalid argument: %s\n", arg);
-        return -1;
+    MemSubsystem previous = mem_enter(MEM_HISTORY); //kept next to the entry
+    scratch->args = parse_line(command_str, &scratch->argc, &scratch->redir);
+    mem_leave(previous);
+    if (scratch->args == NULL || scratch->args[0] == NULL) {
+        fprintf(stderr, "history: parse_line failed\n");
+        free_parsed(scratch);
+        free(command_str);
+        return NULL;
     }
-    //split variable into name and value
-    *equal_sign = '\0';
-    char *name = arg;
-    char *value = equal_sign + 1;
-    if(value[0] == '$'){
-        char *var_name = value +1;
-        char *var_value = getenv(var_name);
-        if(var_value == NULL){
-            var_value = get_shell_var(var_name);
-        }
-        if(var_value != NULL){
-            value = strdup(var_value);
-            if(value == NULL){
-                perror("strdup");
-                return -1;
-            }
-        }else{
-            value = strdup("");
-            if(value ==NULL){
-                perror("strdup");
-                return -1;
-            }
-        }
+    if (scratch->redir.type == REDIR_HEREDOC) {
+        fprintf(stderr, "history: %s: cannot replay a here-document\n", g_history.commands[index]);
+        free_parsed(scratch);
+        free(command_str);
+        return NULL;
     }
-    int status = set_shell_var(name, value);
-    return status;
+    if (strchr(g_history.commands[index], '$') == NULL && get_builtin_command(scratch->args[0]) == NOT_BUILT_IN) {
+        *parsed = *scratch;
+        scratch->args = NULL;
+        free(command_str);
+        return parsed;
+    }
+    free(command_str);
+    return scratch;
 }
 
-int execute_export(char **args, int argc){
-    if (argc != 2) {
-        fprintf(stderr, "export: usage: export VAR=value\n");
+static int replay_history(int command_num){
+    ParsedCommand scratch = {0};
+    ParsedCommand *parsed = history_parse(command_num, &scratch);
+    if (parsed == NULL) {
         return -1;
     }
-    char *arg = args[1];
-    char *equal_sign = strchr(arg, '=');
-    if (equal_sign == NULL) {
-        fprintf(stderr, "export: invalid argument: %s\n", arg);
-        return -1;
+    printf("%s\n", g_history.commands[history_index(command_num)]);
+    fflush(stdout); //echo the command ahead of its output
+    builtin_cmd_t command = get_builtin_command(parsed->args[0]);
+    if(command == NOT_BUILT_IN){
+        execute_external_cmd(parsed->args, NULL, 1, &parsed->redir);
+    }else{
+        execute_builtin_cmd(command, parsed->args, parsed->argc, &parsed->redir);
     }
+    free_parsed(&scratch);
+    return g_status;
+}
 
-    //split variable into name and value
-    *equal_sign = '\0';
-    char *var = arg;
-    char *value = equal_sign + 1;
-    if (setenv(var, value, 1) != 0) {
-        perror("export");
+//replays the selected entries concurrently through the output multiplexer;
+//builtins still run in the shell, one after another
+static int replay_history_parallel(int *command_nums, int count){
+    OutputMux mux;
+    if (mux_init(&mux, 0) == -1) {
         return -1;
     }
-    return 0;
-}
-
-int execute_cd(char **args, int argc){
-     if(argc < 2){
-        char *home = getenv("HOME");
-        if(home == NULL){
-            fprintf(stderr, "cd: HOME not set\n");
-            return -1;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        ParsedCommand scratch = {0};
+        ParsedCommand *parsed = history_parse(command_nums[i], &scratch);
+        if (parsed == NULL) {
+            failed++;
+            continue;
         }
-        if(chdir(home) != 0){
-            perror("chdir");
-            return -1;
+        printf("%s\n", g_history.commands[history_index(command_nums[i])]);
+        builtin_cmd_t command = get_builtin_command(parsed->args[0]);
+        if (command != NOT_BUILT_IN) {
+            execute_builtin_cmd(command, parsed->args, parsed->argc, &parsed->redir);
+            failed += g_status != 0;
+        } else {
+            char *path = find_executable(parsed->args[0]);
+            fflush(stdout);
+            if (path == NULL || mux_spawn(&mux, command_nums[i], path, parsed->args, &parsed->redir) == -1) {
+                failed++;
+            }
+            free(path);
         }
-    }else if(argc == 2){
-        if(chdir(args[1]) != 0){
-            perror("cd error");
-            return -1;
+        free_parsed(&scratch);
+    }
+
+    int id;
+    int status;
+    while (mux_wait(&mux, command_timeout_ms(), &id, &status) == 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
         }
-    }else{
-        fprintf(stderr, "cd: too many arguments\n");
-        return -1;
     }
-    return 0;
+    mux_free(&mux);
+    if (mux.timed_out) {
+        return WSH_TIMEOUT_STATUS;
+    }
+    return failed ? -1 : 0;
 }
 
-void execute_exit(int argc){
-    if(argc == 1){
-        free_shell_vars();
-        free_history();
-        return;
+//history run [-p] A..B | history run [-p] --match pattern
+static int execute_history_run(char **args, int argc){
+    int parallel = 0;
+    int i = 2;
+    if (i < argc && strcmp(args[i], "-p") == 0) {
+        parallel = 1;
+        i++;
     }
-    fprintf(stderr, "exit: too many arguments\n");
-    g_status = -1;
-    return;
-}
 
-int execute_history(char **args, int argc){
-    if(argc > 3){
-        fprintf(stderr, "history: too many arguments\n");
-        return -1;
+    int *command_nums = malloc((g_history.count + 1) * sizeof(int));
+    if (command_nums == NULL) {
+        perror("malloc");
+        exit(1);
     }
-    
-    if(argc == 3 && strcmp(args[1], "set") == 0){
-        int size = atoi(args[2]);
-        if(size <= 0){
-            fprintf(stderr, "history: set: invalid size: %s\n", args[2]);
-            return -1;
+    int count = 0;
+    if (i + 2 == argc && strcmp(args[i], "--match") == 0) {
+        //oldest matching entry first, the order they originally ran in
+        char *pattern = malloc(strlen(args[i + 1]) + 3);
+        if (pattern == NULL) {
+            perror("malloc");
+            exit(1);
         }
-        if(set_history_size(size) == -1){
-            perror("set_history_size");
-            return -1;
+        sprintf(pattern, "*%s*", args[i + 1]);
+        for (int num = g_history.count; num >= 1; num--) {
+            if (fnmatch(pattern, g_history.commands[history_index(num)], 0) == 0) {
+                command_nums[count++] = num;
+            }
         }
-        return 0;
-    }else if(argc == 2){
-        int command_num = atoi(args[1]);
-        if(command_num <= 0 || command_num > g_history.count){
-            fprintf(stderr, "history: %d: event not found\n", command_num);
-            return -1;
+        free(pattern);
+    } else if (i + 1 == argc) {
+        char *end;
+        long from = strtol(args[i], &end, 10);
+        long to = from;
+        if (strncmp(end, "..", 2) == 0) {
+            to = strtol(end + 2, &end, 10);
         }
-        int index = (g_history.start + g_history.count - command_num) % g_history.capacity;
-        char *command_str = g_history.commands[index];
-        printf("%s\n", command_str);
-        char *command_str_copy = strdup(command_str);
-        if(command_str_copy == NULL) {
-            perror("strdup");
-            free_history();
-            free_shell_vars();
+        if (*end != '\0' || from <= 0 || to <= 0 || from > g_history.count || to > g_history.count) {
+            fprintf(stderr, "history: %s: event not found\n", args[i]);
+            free(command_nums);
             return -1;
         }
-        Redirection redir;
-        int arg_count = 0;
-        char **parsed_command = parse_line(command_str, &arg_count, &redir);
-        if(parsed_command == NULL){
-            fprintf(stderr, "history: parse_line failed\n");
-            free(command_str_copy);
-            return -1;
+        int step = from <= to ? 1 : -1;
+        for (long num = from; num != to + step; num += step) {
+            command_nums[count++] = num;
         }
-        if(parsed_command[0] != NULL){
-            builtin_cmd_t command = get_builtin_command(parsed_command[0]);
-            if(command == NOT_BUILT_IN){
-                execute_external_cmd(parsed_command, command_str_copy, 1, &redir);
-            }else{
-                execute_builtin_cmd(command, parsed_command, arg_count, &redir);
+    } else {
+        fprintf(stderr, "history: usage: history run [-p] A..B | history run [-p] --match pattern\n");
+        free(command_nums);
+        return -1;
+    }
+
+    int status = 0;
+    if (parallel) {
+        status = replay_history_parallel(command_nums, count);
+    } else {
+        for (int j = 0; j < count; j++) {
+            if (replay_history(command_nums[j]) != 0) {
+                status = -1;
             }
-        }else{
-            perror("parse_line");
-            return -1;
-        }
-        for(int i = 0; i < arg_count; i++) {
-            free(parsed_command[i]);
-        }
-        free(parsed_command);
-        free(command_str_copy);
-    }else if(argc == 1){
-        for(int i = 0; i < g_history.count; i++){
-            int index = (g_history.start + g_history.count - 1 - i) % g_history.capacity;
-            printf("%d) %s\n", i +1, g_history.commands[index]);
         }
     }
-    return 0;
+    free(command_nums);
+    return status;
 }
 
-int execute_ls() {
-    DIR *d;
-    struct dirent *dir;
-    char **filenames = NULL;
-    size_t count = 0;
-    size_t capacity = 10;
-    d = opendir(".");
-    if (!d) {
-        perror("ls");
-        return -1;
-    }
+static void free_shell_vars(){
+    ShellVariable* current = g_shell_vars_head;
+    while (current != NULL) {
+        ShellVariable*temp = current;
+        current = current->next;
+        snapshot_free(temp->name);
+        snapshot_free(temp->value);
+        snapshot_free(temp);
+    }
+}
+
+//Output multiplexer: children write into pipes that the shell drains with
+//epoll, so concurrent jobs only ever reach the terminal in whole lines.
+//A pidfd per child reports its exit without blocking in waitpid.
+#define MUX_LINE_MAX 65536
+#define MUX_PIDFD 2
+
+static int pidfd_open_fd(pid_t pid){
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void writev_all(int fd, struct iovec *iov, int iovcnt){
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void mux_emit(OutputMux *mux, MuxJob *job, int stream, char *line, size_t len){
+    char prefix[32];
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (mux->tag_lines) {
+        iov[iovcnt].iov_base = prefix;
+        iov[iovcnt].iov_len = snprintf(prefix, sizeof(prefix), "[%d] ", job->id);
+        iovcnt++;
+    }
+    iov[iovcnt].iov_base = line;
+    iov[iovcnt].iov_len = len;
+    iovcnt++;
+    if (len == 0 || line[len - 1] != '\n') {
+        iov[iovcnt].iov_base = "\n";
+        iov[iovcnt].iov_len = 1;
+        iovcnt++;
+    }
+    //one writev per line keeps lines from different jobs apart
+    writev_all(stream == 0 ? STDOUT_FILENO : STDERR_FILENO, iov, iovcnt);
+}
+
+static void mux_close_stream(OutputMux *mux, MuxJob *job, int stream){
+    if (job->lens[stream] > 0) {
+        mux_emit(mux, job, stream, job->bufs[stream], job->lens[stream]);
+        job->lens[stream] = 0;
+    }
+    close(job->fds[stream]); //also drops it from the epoll set
+    job->fds[stream] = -1;
+}
+
+static void mux_drain(OutputMux *mux, MuxJob *job, int stream){
+    //emitting synchronously is the backpressure: while our stdout is slow we
+    //stop reading, the pipe fills and the child blocks in write()
+    while (job->fds[stream] >= 0) {
+        char *buf = job->bufs[stream];
+        ssize_t n = read(job->fds[stream], buf + job->lens[stream], MUX_LINE_MAX - job->lens[stream]);
+        if (n == 0) {
+            mux_close_stream(mux, job, stream);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                mux_close_stream(mux, job, stream);
+            }
+            return;
+        }
+        size_t len = job->lens[stream] + n;
+        size_t start = 0;
+        char *newline;
+        while ((newline = memchr(buf + start, '\n', len - start)) != NULL) {
+            size_t end = newline - buf + 1;
+            mux_emit(mux, job, stream, buf + start, end - start);
+            start = end;
+        }
+        if (start == 0 && len == MUX_LINE_MAX) {
+            //line longer than the buffer, emit it in pieces
+            mux_emit(mux, job, stream, buf, len);
+            start = len;
+        }
+        memmove(buf, buf + start, len - start);
+        job->lens[stream] = len - start;
+    }
+}
+
+static int mux_init(OutputMux *mux, int tag_lines){
+    mux->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (mux->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    mux->tag_lines = tag_lines;
+    mux->jobs = NULL;
+    mux->capacity = 0;
+    mux->running = 0;
+    mux->timed_out = 0;
+    mux->kill_at = 0;
+    return 0;
+}
+
+static int mux_watch(OutputMux *mux, int fd, int slot, int kind){
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t)slot << 2) | kind;
+    return epoll_ctl(mux->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int mux_spawn(OutputMux *mux, int id, const char *path, char **args, Redirection *redir){
+    int out[2];
+    int err[2];
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    if (pipe2(err, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+    int in_fd = -1;
+    if (redir != NULL && redir->type == REDIR_INPUT) {
+        posix_spawn_file_actions_addopen(&actions, redir->fd, redir->file, O_RDONLY, 0);
+    } else if (redir != NULL && is_input_redirection(redir->type)) {
+        in_fd = open_input_redirection(redir);
+        if (in_fd >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, in_fd, redir->fd);
+        }
+    } else if (redir != NULL && (redir->type == REDIR_OUTPUT || redir->type == REDIR_OUTPUT_APPEND)) {
+        int flags = O_WRONLY | O_CREAT | (redir->type == REDIR_OUTPUT_APPEND ? O_APPEND : O_TRUNC);
+        posix_spawn_file_actions_addopen(&actions, redir->fd, redir->file, flags, 0644);
+    } else if (redir != NULL && (redir->type == REDIR_OUTPUT_ERROR || redir->type == REDIR_OUTPUT_ERROR_APPEND)) {
+        int flags = O_WRONLY | O_CREAT | (redir->type == REDIR_OUTPUT_ERROR_APPEND ? O_APPEND : O_TRUNC);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, redir->file, flags, 0644);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+    //posix_spawn children inherit this thread's cpu mask and memory policy,
+    //so place the thread around the spawn and restore it afterwards
+    Placement placement;
+    cpu_set_t saved_cpus;
+    int placed = placement_next(&placement) && sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus) == 0;
+    if (placed) {
+        placement_apply(&placement);
+    }
+    pid_t pid;
+    int rc = posix_spawn(&pid, path, &actions, NULL, args, environ);
+    if (placed) {
+        sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+        if (placement.node >= 0) {
+            syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+    close(err[1]);
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (rc != 0) {
+        errno = rc;
+        perror("wsh: spawn");
+        close(out[0]);
+        close(err[0]);
+        return -1;
+    }
+
+    int pidfd = pidfd_open_fd(pid);
+    if (pidfd < 0) {
+        perror("pidfd_open");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(out[0]);
+        close(err[0]);
+        return -1;
+    }
+
+    //find a free slot, growing the table when every slot is busy
+    int slot = 0;
+    while (slot < mux->capacity && mux->jobs[slot].pid != 0) {
+        slot++;
+    }
+    if (slot == mux->capacity) {
+        int new_capacity = mux->capacity ? mux->capacity * 2 : 4;
+        MuxJob *jobs = realloc(mux->jobs, new_capacity * sizeof(MuxJob));
+        if (jobs == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(jobs + mux->capacity, 0, (new_capacity - mux->capacity) * sizeof(MuxJob));
+        mux->jobs = jobs;
+        mux->capacity = new_capacity;
+    }
+
+    MuxJob *job = &mux->jobs[slot];
+    for (int stream = 0; stream < 2; stream++) {
+        if (job->bufs[stream] == NULL) {
+            job->bufs[stream] = malloc(MUX_LINE_MAX);
+            if (job->bufs[stream] == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+        job->lens[stream] = 0;
+    }
+    job->id = id;
+    job->pid = pid;
+    job->pidfd = pidfd;
+    job->fds[0] = out[0];
+    job->fds[1] = err[0];
+    job->exited = 0;
+    job->status = 0;
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+    mux_watch(mux, out[0], slot, 0);
+    mux_watch(mux, err[0], slot, 1);
+    mux_watch(mux, pidfd, slot, MUX_PIDFD);
+    mux->running++;
+    return 0;
+}
+
+static void mux_signal(OutputMux *mux, int sig){
+    for (int slot = 0; slot < mux->capacity; slot++) {
+        MuxJob *job = &mux->jobs[slot];
+        if (job->pid != 0 && !job->exited) {
+            kill(job->pid, sig);
+        }
+    }
+}
+
+//runs the event loop until some job has exited and its output is drained;
+//returns -1 once no jobs are left. When timeout_ms (-1 for none) passes, all
+//remaining jobs get SIGTERM, then SIGKILL after the grace period, and
+//mux->timed_out is set; they are still returned here as they are reaped.
+static int mux_wait(OutputMux *mux, int timeout_ms, int *id, int *status){
+    struct epoll_event events[16];
+    long long expires = timeout_ms >= 0 ? monotonic_ms() + timeout_ms : 0;
+    while (1) {
+        for (int slot = 0; slot < mux->capacity; slot++) {
+            MuxJob *job = &mux->jobs[slot];
+            if (job->pid != 0 && job->exited && mux->timed_out) {
+                //a killed job's descendants may still hold its pipes open
+                for (int stream = 0; stream < 2; stream++) {
+                    mux_drain(mux, job, stream);
+                    if (job->fds[stream] >= 0) {
+                        mux_close_stream(mux, job, stream);
+                    }
+                }
+            }
+            if (job->pid != 0 && job->exited && job->fds[0] < 0 && job->fds[1] < 0) {
+                *id = job->id;
+                *status = job->status;
+                close(job->pidfd);
+                job->pid = 0;
+                mux->running--;
+                return 0;
+            }
+        }
+        if (mux->running == 0) {
+            return -1;
+        }
+
+        int wait_ms = -1;
+        long long now = monotonic_ms();
+        if (!mux->timed_out && timeout_ms >= 0) {
+            wait_ms = expires > now ? (int)(expires - now) : 0;
+        } else if (mux->kill_at != 0) {
+            wait_ms = mux->kill_at > now ? (int)(mux->kill_at - now) : 0;
+        }
+        if (wait_ms == 0) {
+            if (!mux->timed_out) {
+                mux_signal(mux, SIGTERM);
+                mux->timed_out = 1;
+                mux->kill_at = now + TIMEOUT_KILL_GRACE_MS;
+            } else {
+                mux_signal(mux, SIGKILL);
+                mux->kill_at = 0;
+            }
+            continue;
+        }
+
+        int n = epoll_wait(mux->epfd, events, 16, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            MuxJob *job = &mux->jobs[events[i].data.u64 >> 2];
+            int kind = events[i].data.u64 & 3;
+            if (kind == MUX_PIDFD) {
+                //the pidfd is readable, so this reap never blocks
+                if (waitpid(job->pid, &job->status, WNOHANG) > 0) {
+                    job->exited = 1;
+                    epoll_ctl(mux->epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+                }
+            } else {
+                mux_drain(mux, job, kind);
+            }
+        }
+    }
+}
+
+static void mux_free(OutputMux *mux){
+    int id;
+    int status;
+    while (mux_wait(mux, command_timeout_ms(), &id, &status) == 0) {
+        ;
+    }
+    for (int slot = 0; slot < mux->capacity; slot++) {
+        free(mux->jobs[slot].bufs[0]);
+        free(mux->jobs[slot].bufs[1]);
+    }
+    free(mux->jobs);
+    close(mux->epfd);
+}
+
+static long long monotonic_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//parses a non-negative number of seconds into milliseconds. Durations that
+//do not fit in an int (about 24 days) are clamped, since poll() takes an int.
+static int parse_duration_ms(const char *text, int *ms){
+    char *end;
+    double secs = strtod(text, &end);
+    if (end == text || *end != '\0' || !(secs >= 0)) {
+        return -1; //also rejects nan
+    }
+    *ms = secs * 1000 < INT_MAX ? (int)(secs * 1000) : INT_MAX;
+    return 0;
+}
+
+static int deadline_remaining_ms(){
+    if (g_deadline_ms == 0) {
+        return -1; //no deadline
+    }
+    long long left = g_deadline_ms - monotonic_ms();
+    return left > 0 ? (int)left : 0;
+}
+
+//polls a pidfd, restarting on signals; returns 1 once the child has exited
+static int poll_pidfd(int pidfd, int timeout_ms){
+    struct pollfd pfd = {.fd = pidfd, .events = POLLIN};
+    long long end = monotonic_ms() + timeout_ms;
+    while (1) {
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        long long left = end - monotonic_ms();
+        timeout_ms = left > 0 ? (int)left : 0;
+    }
+}
+
+//tightest of the timeout builtin's limit and the script deadline, -1 for none
+static int command_timeout_ms(){
+    int timeout_ms = g_cmd_timeout_ms;
+    int deadline_ms = deadline_remaining_ms();
+    if (deadline_ms >= 0 && (timeout_ms < 0 || deadline_ms < timeout_ms)) {
+        timeout_ms = deadline_ms;
+    }
+    return timeout_ms;
+}
+
+//waits for pid, killing it once timeout_ms (-1 for none) has passed;
+//returns 1 if the child was killed, 0 if it finished and -1 on an error,
+//which has been reported
+static int wait_child(pid_t pid, int timeout_ms, int *status){
+    if (timeout_ms < 0) {
+        while (1) {
+            if (waitpid(pid, status, WUNTRACED) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("waitpid");
+                return -1;
+            }
+            if (WIFEXITED(*status) || WIFSIGNALED(*status)) {
+                return 0;
+            }
+        }
+    }
+
+    int pidfd = pidfd_open_fd(pid);
+    if (pidfd < 0) {
+        perror("pidfd_open");
+        return wait_child(pid, -1, status);
+    }
+    int timed_out = 0;
+    int polled = poll_pidfd(pidfd, timeout_ms);
+    if (polled == -1) {
+        //the time limit can no longer be enforced, so do not wait unbounded
+        perror("poll");
+        timed_out = -1;
+        kill(pid, SIGKILL);
+    } else if (polled == 0) {
+        timed_out = 1;
+        kill(pid, SIGTERM);
+        if (poll_pidfd(pidfd, TIMEOUT_KILL_GRACE_MS) != 1) {
+            kill(pid, SIGKILL);
+        }
+    }
+    close(pidfd);
+
+    //the child has exited or been killed, so this does not block for long
+    while (waitpid(pid, status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    return timed_out;
+}
+
+//Output cache for the cached builtin: one file per entry named by the
+//hash of everything the command's result depends on
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len){
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a_file(uint64_t hash, const char *path){
+    struct stat st;
+    long long ident[5] = {0};
+    hash = fnv1a(hash, path, strlen(path) + 1);
+    if (stat(path, &st) == 0) {
+        ident[0] = st.st_dev;
+        ident[1] = st.st_ino;
+        ident[2] = st.st_size;
+        ident[3] = st.st_mtim.tv_sec;
+        ident[4] = st.st_mtim.tv_nsec;
+    }
+    return fnv1a(hash, ident, sizeof(ident));
+}
+
+static uint64_t cache_key(char **args, const char *path, Redirection *redir){
+    uint64_t hash = 14695981039346656037ULL;
+    char cwd[PATH_MAX];
+
+    for (int i = 0; args[i] != NULL; i++) {
+        hash = fnv1a(hash, args[i], strlen(args[i]) + 1);
+    }
+    hash = fnv1a_file(hash, path); //a rebuilt binary is a different command
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        hash = fnv1a(hash, cwd, strlen(cwd) + 1);
+    }
+    for (char **env = environ; *env != NULL; env++) {
+        if (strncmp(*env, "WSH_CACHE_", 10) != 0) { //cache settings do not change output
+            hash = fnv1a(hash, *env, strlen(*env) + 1);
+        }
+    }
+    if (redir->type == REDIR_INPUT) {
+        hash = fnv1a_file(hash, redir->file);
+    } else if (is_input_redirection(redir->type) && redir->data != NULL) {
+        hash = fnv1a(hash, redir->data, redir->data_len);
+    }
+    return hash;
+}
+
+static int cache_dir(char *dir, size_t size){
+    char *env = getenv("WSH_CACHE_DIR");
+    char *home = getenv("HOME");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(dir, size, "%s", env);
+    } else if (home != NULL) {
+        snprintf(dir, size, "%s/.cache", home);
+        mkdir(dir, 0700);
+        snprintf(dir, size, "%s/.cache/wsh", home);
+    } else {
+        snprintf(dir, size, "/tmp/wsh-cache-%d", (int)getuid());
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("cached: mkdir");
+        return -1;
+    }
+    return 0;
+}
+
+//copies len bytes at *offset of in_fd to out_fd, in the kernel when possible
+static int send_all(int out_fd, int in_fd, off_t *offset, uint64_t len){
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, in_fd, offset, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            //out_fd does not support sendfile, fall back to read/write
+            char buf[65536];
+            n = pread(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf), *offset);
+            if (n > 0) {
+                struct iovec iov = {.iov_base = buf, .iov_len = n};
+                writev_all(out_fd, &iov, 1);
+                *offset += n;
+            }
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+static int cache_scan(const char *dir, CacheEntry **entries, int *count, long long *total){
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("cached: opendir");
+        return -1;
+    }
+    int capacity = 16;
+    *entries = malloc(capacity * sizeof(CacheEntry));
+    if (*entries == NULL) {
+        perror("malloc");
+        closedir(d);
+        exit(1);
+    }
+    *count = 0;
+    *total = 0;
+
+    struct dirent *dent;
+    while ((dent = readdir(d)) != NULL) {
+        //entries are exactly 16 hex digits; skip temp files of running commands
+        struct stat st;
+        if (strlen(dent->d_name) != 16 || fstatat(dirfd(d), dent->d_name, &st, 0) != 0) {
+            continue;
+        }
+        if (*count >= capacity) {
+            capacity *= 2;
+            *entries = realloc(*entries, capacity * sizeof(CacheEntry));
+            if (*entries == NULL) {
+                perror("realloc");
+                closedir(d);
+                exit(1);
+            }
+        }
+        CacheEntry *entry = &(*entries)[(*count)++];
+        memcpy(entry->name, dent->d_name, sizeof(entry->name));
+        entry->size = st.st_size;
+        entry->used = st.st_mtim;
+        *total += st.st_size;
+    }
+    closedir(d);
+    return 0;
+}
+
+static int compare_cache_entries(const void *a, const void *b){
+    const CacheEntry *entry_a = a;
+    const CacheEntry *entry_b = b;
+    if (entry_a->used.tv_sec != entry_b->used.tv_sec) {
+        return entry_a->used.tv_sec < entry_b->used.tv_sec ? -1 : 1;
+    }
+    if (entry_a->used.tv_nsec != entry_b->used.tv_nsec) {
+        return entry_a->used.tv_nsec < entry_b->used.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+//drops least recently used entries until the cache fits WSH_CACHE_MAX bytes
+static void cache_evict(const char *dir){
+    long long max_bytes = CACHE_DEFAULT_MAX_BYTES;
+    char *env = getenv("WSH_CACHE_MAX");
+    if (env != NULL && atoll(env) > 0) {
+        max_bytes = atoll(env);
+    }
+
+    CacheEntry *entries;
+    int count;
+    long long total;
+    if (cache_scan(dir, &entries, &count, &total) == -1) {
+        return;
+    }
+    if (total > max_bytes) {
+        qsort(entries, count, sizeof(CacheEntry), compare_cache_entries);
+        char path[PATH_MAX + 32];
+        for (int i = 0; i < count && total > max_bytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            if (unlink(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+}
+
+static int cache_replay(int out_fd, off_t out_offset, int err_fd, off_t err_offset, CacheHeader *hdr){
+    send_all(STDOUT_FILENO, out_fd, &out_offset, hdr->out_len);
+    send_all(STDERR_FILENO, err_fd, &err_offset, hdr->err_len);
+    return (WIFEXITED(hdr->status) && WEXITSTATUS(hdr->status) == 0) ? 0 : -1;
+}
+
+//runs the command with stdout/stderr captured into a new entry, then replays it
+static int cache_store(const char *entry, const char *path, char **args){
+    char tmp_out[PATH_MAX + 64];
+    char tmp_err[PATH_MAX + 64];
+    snprintf(tmp_out, sizeof(tmp_out), "%s.%d.out", entry, (int)getpid());
+    snprintf(tmp_err, sizeof(tmp_err), "%s.%d.err", entry, (int)getpid());
+
+    int out_fd = open(tmp_out, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out_fd < 0) {
+        perror("cached: open");
+        return -1;
+    }
+    int err_fd = open(tmp_err, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (err_fd < 0) {
+        perror("cached: open");
+        close(out_fd);
+        unlink(tmp_out);
+        return -1;
+    }
+    unlink(tmp_err); //only needed until it is appended to the entry
+
+    //the header is rewritten once the lengths are known
+    CacheHeader hdr = {.magic = 0};
+    if (write(out_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        perror("cached: write");
+        close(out_fd);
+        close(err_fd);
+        unlink(tmp_out);
+        return -1;
+    }
+    hdr.magic = CACHE_MAGIC;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        execv(path, args);
+        perror("wsh");
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("wsh: fork");
+        close(out_fd);
+        close(err_fd);
+        unlink(tmp_out);
+        return -1;
+    }
+    int timed_out = wait_child(pid, command_timeout_ms(), &hdr.status);
+
+    hdr.out_len = lseek(out_fd, 0, SEEK_END) - sizeof(CacheHeader);
+    hdr.err_len = lseek(err_fd, 0, SEEK_END);
+    int status = cache_replay(out_fd, sizeof(CacheHeader), err_fd, 0, &hdr);
+
+    //only completed runs are stored; killed or failed spawns are retried next time
+    off_t err_offset = 0;
+    if (timed_out == 0 && !WIFSIGNALED(hdr.status)
+            && send_all(out_fd, err_fd, &err_offset, hdr.err_len) == 0
+            && pwrite(out_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+            && rename(tmp_out, entry) == 0) {
+        close(out_fd);
+    } else {
+        close(out_fd);
+        unlink(tmp_out);
+    }
+    close(err_fd);
+    if (timed_out == 1) {
+        return WSH_TIMEOUT_STATUS;
+    }
+    return status;
+}
+
+//searches a colon separated directory list for an executable
+static char *search_path(char *dirs, const char *name){
+    char *path = NULL;
+    char *saveptr;
+    char *token = strtok_r(dirs, ":", &saveptr);
+    while (token != NULL) {
+        path = malloc(strlen(token) + strlen(name) + 2);
+        if (!path) {
+            perror("malloc");
+            exit(1);
+        }
+        sprintf(path, "%s/%s", token, name);
+        if (access(path, X_OK) == 0) {
+            break;  //found
+        }
+        free(path);
+        path = NULL;
+        token = strtok_r(NULL, ":", &saveptr);
+    }
+    return path;
+}
+
+//Executable cache: name -> resolved path under the PATH it was filled with.
+//Shared with the batch lookahead thread, so every access holds the lock.
+static unsigned exec_cache_bucket(const char *name){
+    return (unsigned)(fnv1a(14695981039346656037ULL, name, strlen(name)) % EXEC_CACHE_BUCKETS);
+}
+
+static void exec_cache_reset(const char *path_env){
+    for (int i = 0; i < EXEC_CACHE_BUCKETS; i++) {
+        ExecCacheEntry *entry = g_exec_cache[i];
+        while (entry != NULL) {
+            ExecCacheEntry *next = entry->next;
+            snapshot_free(entry->name);
+            snapshot_free(entry->path);
+            snapshot_free(entry);
+            entry = next;
+        }
+        g_exec_cache[i] = NULL;
+    }
+    snapshot_free(g_exec_cache_path);
+    g_exec_cache_path = path_env ? strdup(path_env) : NULL;
+    g_exec_cache_gen++;
+}
+
+static ExecCacheEntry *exec_cache_lookup(const char *name){
+    ExecCacheEntry *entry = g_exec_cache[exec_cache_bucket(name)];
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void exec_cache_remove(const char *name){
+    ExecCacheEntry **link = &g_exec_cache[exec_cache_bucket(name)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        ExecCacheEntry *entry = *link;
+        *link = entry->next;
+        snapshot_free(entry->name);
+        snapshot_free(entry->path);
+        snapshot_free(entry);
+    }
+}
+
+//resolves name outside the lock and stores it unless PATH changed meanwhile
+static char *exec_cache_fill(const char *name){
+    if (g_exec_cache_path == NULL) {
+        pthread_mutex_unlock(&g_exec_cache_lock);
+        return NULL;
+    }
+    unsigned gen = g_exec_cache_gen;
+    char *dirs = strdup(g_exec_cache_path);
+    pthread_mutex_unlock(&g_exec_cache_lock);
+    if (dirs == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    char *path = search_path(dirs, name);
+    free(dirs);
+    if (path == NULL) {
+        return NULL; //misses are not cached, the file may appear later
+    }
+
+    pthread_mutex_lock(&g_exec_cache_lock);
+    if (gen == g_exec_cache_gen && exec_cache_lookup(name) == NULL) {
+        ExecCacheEntry *entry = malloc(sizeof(ExecCacheEntry));
+        if (entry == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        entry->name = strdup(name);
+        entry->path = strdup(path);
+        if (entry->name == NULL || entry->path == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        unsigned bucket = exec_cache_bucket(name);
+        entry->next = g_exec_cache[bucket];
+        g_exec_cache[bucket] = entry;
+    }
+    pthread_mutex_unlock(&g_exec_cache_lock);
+    return path;
+}
+
+static char *find_executable(const char *name){
+    char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = "/bin";
+    }
+
+    pthread_mutex_lock(&g_exec_cache_lock);
+    if (g_exec_cache_path == NULL || strcmp(g_exec_cache_path, path_env) != 0) {
+        exec_cache_reset(path_env); //PATH was exported since the last lookup
+    }
+    ExecCacheEntry *entry = exec_cache_lookup(name);
+    if (entry != NULL && access(entry->path, X_OK) != 0) {
+        exec_cache_remove(name); //deleted or no longer executable, search again
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        char *path = strdup(entry->path);
+        pthread_mutex_unlock(&g_exec_cache_lock);
+        if (path == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        return path;
+    }
+    return exec_cache_fill(name); //releases the lock
+}
+
+//warms the cache from the lookahead thread, which must not read the environment
+static void exec_cache_prefetch(const char *name){
+    pthread_mutex_lock(&g_exec_cache_lock);
+    if (exec_cache_lookup(name) != NULL) {
+        pthread_mutex_unlock(&g_exec_cache_lock);
+        return;
+    }
+    free(exec_cache_fill(name));
+}
+
+//Batch lookahead: a helper thread reads the script up to LOOKAHEAD_LINES
+//ahead of run_loop, resolving upcoming commands into the executable cache
+//and asking the kernel to read upcoming < input files into the page cache.
+static void lookahead_line(char *line){
+    char *saveptr;
+    char *token = strtok_r(line, " \t\n", &saveptr);
+    if (token == NULL || token[0] == '#') {
+        return;
+    }
+
+    //look through prefix builtins to the command they run
+    int index = 0;
+    int command_index = 0;
+    builtin_cmd_t command = get_builtin_command(token);
+    if (command == CMD_TIMEOUT) {
+        command_index = 2;
+    } else if (command == CMD_CACHED) {
+        command_index = 1;
+    } else if (command != NOT_BUILT_IN) {
+        command_index = -1;
+    }
+
+    while (token != NULL) {
+        int fd = -1;
+        struct stat st;
+        char *redir_pos = strchr(token, '<');
+        if (index == command_index && token[0] != '$' && strchr(token, '/') == NULL) {
+            exec_cache_prefetch(token);
+        } else if (redir_pos != NULL && get_redirection_type(token, &fd) == REDIR_INPUT && redir_pos[1] != '\0' &&
+                   stat(redir_pos + 1, &st) == 0 && S_ISREG(st.st_mode)) {
+            //only regular files: opening a FIFO here would pair with its
+            //writer, and closing it again would break the pipe
+            int file_fd = open(redir_pos + 1, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (file_fd >= 0) {
+                posix_fadvise(file_fd, 0, 0, POSIX_FADV_WILLNEED);
+                close(file_fd);
+            }
+        }
+        index++;
+        token = strtok_r(NULL, " \t\n", &saveptr);
+    }
+}
+
+static void *lookahead_main(void *arg){
+    FILE *script = arg;
+    char *line = NULL;
+    size_t buffer_size = 0;
+    long line_no = 0;
+    (void)mem_enter(MEM_EXEC); //everything this thread keeps is executable cache
+
+    while (getline(&line, &buffer_size, script) != -1) {
+        pthread_mutex_lock(&g_lookahead.lock);
+        while (!g_lookahead.stop && line_no >= g_lookahead.consumed + LOOKAHEAD_LINES) {
+            pthread_cond_wait(&g_lookahead.cond, &g_lookahead.lock);
+        }
+        int stop = g_lookahead.stop;
+        pthread_mutex_unlock(&g_lookahead.lock);
+        if (stop) {
+            break;
+        }
+        lookahead_line(line);
+        line_no++;
+    }
+    free(line);
+    fclose(script);
+    return NULL;
+}
+
+static void lookahead_start(const char *script_path){
+    //a second reader on a pipe or fifo would steal the script's lines
+    struct stat st;
+    if (stat(script_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    FILE *script = fopen(script_path, "r");
+    if (script == NULL) {
+        return; //only a hint, run_loop reports real errors
+    }
+    if (pthread_create(&g_lookahead.thread, NULL, lookahead_main, script) != 0) {
+        fclose(script);
+        return;
+    }
+    g_lookahead.running = 1;
+}
+
+static void lookahead_advance(){
+    if (!g_lookahead.running) {
+        return;
+    }
+    pthread_mutex_lock(&g_lookahead.lock);
+    g_lookahead.consumed++;
+    pthread_cond_signal(&g_lookahead.cond);
+    pthread_mutex_unlock(&g_lookahead.lock);
+}
+
+static void lookahead_stop(){
+    if (!g_lookahead.running) {
+        return;
+    }
+    pthread_mutex_lock(&g_lookahead.lock);
+    g_lookahead.stop = 1;
+    pthread_cond_signal(&g_lookahead.cond);
+    pthread_mutex_unlock(&g_lookahead.lock);
+    pthread_join(g_lookahead.thread, NULL);
+    g_lookahead.running = 0;
+}
+
+//Buffered line splitter: reads large blocks and finds newlines with memchr,
+//handing out lines that point straight into its buffer
+static void line_reader_init(LineReader *reader, int fd){
+    reader->fd = fd;
+    reader->buf = malloc(LINE_READER_SIZE);
+    if (reader->buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    reader->cap = LINE_READER_SIZE;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+}
+
+//returns the next line without its newline (valid until the next call),
+//or NULL at end of input
+static char *line_reader_next(LineReader *reader, size_t *len){
+    while (1) {
+        char *line = reader->buf + reader->start;
+        char *newline = memchr(line, '\n', reader->end - reader->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            *len = newline - line;
+            reader->start += *len + 1;
+            return line;
+        }
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            reader->buf[reader->end] = '\0'; //last line without a newline
+            *len = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        //keep the partial line and make room for more input
+        if (reader->start > 0) {
+            memmove(reader->buf, line, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end + 1 >= reader->cap) {
+            reader->cap *= 2;
+            reader->buf = realloc(reader->buf, reader->cap);
+            if (reader->buf == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            reader->eof = 1;
+        } else {
+            reader->end += n;
+        }
+    }
+}
+
+static void line_reader_free(LineReader *reader){
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+//returns the read builtin's reader for a seekable fd. The buffer survives
+//between invocations and is dropped when fd now refers to another file or
+//was moved by someone else. The kernel offset is kept at the first unread
+//line, so commands run in between see the same input as read would.
+static LineReader *read_buffer_get(int fd){
+    ReadBuffer *rb = &g_read_buffers[fd];
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (rb->reader.buf != NULL && (rb->dev != st.st_dev || rb->ino != st.st_ino || rb->offset != offset)) {
+        line_reader_free(&rb->reader);
+    }
+    if (rb->reader.buf == NULL) {
+        line_reader_init(&rb->reader, fd);
+        rb->dev = st.st_dev;
+        rb->ino = st.st_ino;
+    } else {
+        //skip what is already buffered, the reader continues after it
+        lseek(fd, offset + (off_t)(rb->reader.end - rb->reader.start), SEEK_SET);
+    }
+    return &rb->reader;
+}
+
+static void read_buffer_release(int fd){
+    ReadBuffer *rb = &g_read_buffers[fd];
+    rb->offset = lseek(fd, 0, SEEK_CUR);
+    if (rb->offset != -1) {
+        rb->offset -= (off_t)(rb->reader.end - rb->reader.start);
+        lseek(fd, rb->offset, SEEK_SET);
+    }
+    rb->reader.eof = 0; //a terminal or growing file may have more later
+}
+
+//reads one line from a pipe, socket or terminal without consuming anything
+//after its newline, since read-ahead cannot be given back to such an fd.
+//Pipes are peeked with tee(2) into a scratch pipe and sockets with MSG_PEEK,
+//so only the bytes up to the newline are then read; anything else is read
+//a byte at a time. Returns NULL at end of input.
+static char *read_unbuffered_line(int fd, size_t *len){
+    static int peek_pipe[2] = {-1, -1};
+    struct stat st;
+    mode_t type = fstat(fd, &st) == 0 ? (st.st_mode & S_IFMT) : 0;
+    if (type == S_IFIFO && peek_pipe[0] < 0 && pipe2(peek_pipe, O_CLOEXEC) == -1) {
+        peek_pipe[0] = peek_pipe[1] = -1;
+    }
+
+    char *chunk = malloc(LINE_READER_SIZE);
+    if (chunk == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int done = 0;
+    *len = 0;
+    while (!done) {
+        ssize_t n;
+        int peeked = 1;
+        if (type == S_IFIFO && peek_pipe[0] >= 0) {
+            n = tee(fd, peek_pipe[1], LINE_READER_SIZE, 0);
+            for (ssize_t got = 0; n > 0 && got < n; ) {
+                ssize_t r = read(peek_pipe[0], chunk + got, n - got);
+                if (r <= 0) {
+                    n = -1;
+                    break;
+                }
+                got += r;
+            }
+        } else if (type == S_IFSOCK) {
+            n = recv(fd, chunk, LINE_READER_SIZE, MSG_PEEK);
+        } else {
+            n = read(fd, chunk, 1);
+            peeked = 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break; //end of input, or an error that ends the line
+        }
+
+        //take the peeked bytes up to and including the newline
+        char *newline = memchr(chunk, '\n', n);
+        size_t take = newline ? (size_t)(newline - chunk) + 1 : (size_t)n;
+        done = newline != NULL;
+        for (size_t got = 0; peeked && got < take; ) {
+            ssize_t r = read(fd, chunk + got, take - got);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                take = got;
+                done = 1;
+                break;
+            }
+            got += r;
+        }
+        buf_append(&line, len, &cap, chunk, take);
+    }
+    free(chunk);
+    if (line != NULL && *len > 0 && line[*len - 1] == '\n') {
+        line[--*len] = '\0';
+    } else if (line != NULL && *len == 0) {
+        free(line);
+        line = NULL;
+    }
+    return line;
+}
+
+static void read_buffers_free(){
+    for (int fd = 0; fd < READ_MAX_FD; fd++) {
+        line_reader_free(&g_read_buffers[fd].reader);
+    }
+}
+
+//State snapshots: --save-state writes variables, history and the executable
+//cache as string offsets into one file, --load-state maps that file
+//privately and points the shell's structures straight into it. Anything
+//changed later is replaced by a fresh allocation, so the mapping is only
+//ever read (and copied on write by the kernel if it were touched).
+static int in_snapshot(const void *p){
+    const char *c = p;
+    if (g_snapshot.base == NULL) {
+        return 0;
+    }
+    return (c >= g_snapshot.base && c < g_snapshot.base + g_snapshot.size)
+        || (c >= (char *)g_snapshot.vars && c < (char *)(g_snapshot.vars + g_snapshot.var_count))
+        || (c >= (char *)g_snapshot.execs && c < (char *)(g_snapshot.execs + g_snapshot.exec_count));
+}
+
+static void snapshot_free(void *p){
+    if (!in_snapshot(p)) {
+        free(p);
+    }
+}
+
+static uint64_t state_add_string(char **pool, size_t *len, size_t *cap, size_t table_size, const char *str){
+    uint64_t offset = table_size + *len;
+    buf_append(pool, len, cap, str, strlen(str) + 1);
+    return offset;
+}
+
+static int save_state(const char *path){
+    StateHeader hdr = {.magic = STATE_MAGIC, .version = STATE_VERSION};
+    for (ShellVariable *var = g_shell_vars_head; var != NULL; var = var->next) {
+        hdr.var_count++;
+    }
+    hdr.history_count = g_history.count;
+    hdr.history_capacity = g_history.capacity;
+    pthread_mutex_lock(&g_exec_cache_lock);
+    for (int i = 0; i < EXEC_CACHE_BUCKETS; i++) {
+        for (ExecCacheEntry *entry = g_exec_cache[i]; entry != NULL; entry = entry->next) {
+            hdr.exec_count++;
+        }
+    }
+
+    size_t records = hdr.var_count + hdr.history_count + hdr.exec_count;
+    size_t table_size = sizeof(StateHeader) + records * sizeof(StateRecord);
+    StateRecord *table = calloc(records ? records : 1, sizeof(StateRecord));
+    if (table == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    hdr.vars_offset = sizeof(StateHeader);
+    hdr.history_offset = hdr.vars_offset + hdr.var_count * sizeof(StateRecord);
+    hdr.exec_offset = hdr.history_offset + hdr.history_count * sizeof(StateRecord);
+
+    char *pool = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    StateRecord *record = table;
+    for (ShellVariable *var = g_shell_vars_head; var != NULL; var = var->next, record++) {
+        record->key = state_add_string(&pool, &len, &cap, table_size, var->name);
+        record->value = state_add_string(&pool, &len, &cap, table_size, var->value);
+    }
+    for (int i = 0; i < g_history.count; i++, record++) {
+        int index = (g_history.start + i) % g_history.capacity; //oldest first
+        record->key = state_add_string(&pool, &len, &cap, table_size, g_history.commands[index]);
+    }
+    for (int i = 0; i < EXEC_CACHE_BUCKETS; i++) {
+        for (ExecCacheEntry *entry = g_exec_cache[i]; entry != NULL; entry = entry->next, record++) {
+            record->key = state_add_string(&pool, &len, &cap, table_size, entry->name);
+            record->value = state_add_string(&pool, &len, &cap, table_size, entry->path);
+        }
+    }
+    if (g_exec_cache_path != NULL) {
+        hdr.path_offset = state_add_string(&pool, &len, &cap, table_size, g_exec_cache_path);
+    }
+    pthread_mutex_unlock(&g_exec_cache_lock);
+    buf_append(&pool, &len, &cap, "", 1); //loaders rely on a final NUL
+    hdr.size = table_size + len;
+
+    //write next to the target and rename, so a reader never maps a partial file
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int status = -1;
+    if (fd >= 0) {
+        struct iovec iov[3] = {
+            {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+            {.iov_base = table, .iov_len = records * sizeof(StateRecord)},
+            {.iov_base = pool, .iov_len = len},
+        };
+        writev_all(fd, iov, 3);
+        status = (close(fd) == 0 && rename(tmp, path) == 0) ? 0 : -1;
+    }
+    if (status == -1) {
+        perror("wsh: save-state");
+        unlink(tmp);
+    }
+    free(table);
+    free(pool);
+    return status;
+}
+
+static int state_table_ok(StateHeader *hdr, uint64_t offset, uint64_t count, size_t size){
+    if (offset > size || count > (size - offset) / sizeof(StateRecord)) {
+        return 0;
+    }
+    StateRecord *table = (StateRecord *)((char *)hdr + offset);
+    for (uint64_t i = 0; i < count; i++) {
+        if (table[i].key >= size || table[i].value >= size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int load_state(const char *path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("wsh: load-state");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StateHeader)) {
+        fprintf(stderr, "wsh: load-state: %s: not a state file\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("wsh: load-state: mmap");
+        return -1;
+    }
+
+    //every string offset lies inside the file and the file ends in a NUL,
+    //so every string is terminated
+    StateHeader *hdr = (StateHeader *)base;
+    if (hdr->magic != STATE_MAGIC || hdr->version != STATE_VERSION || hdr->size != size
+            || base[size - 1] != '\0' || hdr->path_offset >= size
+            || hdr->history_capacity < 1 || hdr->history_capacity > MAX_HISTORY_SIZE
+            || hdr->history_count > hdr->history_capacity
+            || !state_table_ok(hdr, hdr->vars_offset, hdr->var_count, size)
+            || !state_table_ok(hdr, hdr->history_offset, hdr->history_count, size)
+            || !state_table_ok(hdr, hdr->exec_offset, hdr->exec_count, size)) {
+        fprintf(stderr, "wsh: load-state: %s: not a state file\n", path);
+        munmap(base, size);
+        return -1;
+    }
+
+    g_snapshot.base = base;
+    g_snapshot.size = size;
+    g_snapshot.vars = calloc(hdr->var_count ? hdr->var_count : 1, sizeof(ShellVariable));
+    g_snapshot.execs = calloc(hdr->exec_count ? hdr->exec_count : 1, sizeof(ExecCacheEntry));
+    g_history.commands = malloc(hdr->history_capacity * sizeof(char *));
+    g_history.parsed = calloc(hdr->history_capacity, sizeof(ParsedCommand));
+    if (g_snapshot.vars == NULL || g_snapshot.execs == NULL || g_history.commands == NULL || g_history.parsed == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    g_snapshot.var_count = hdr->var_count;
+    g_snapshot.exec_count = hdr->exec_count;
+
+    StateRecord *vars = (StateRecord *)(base + hdr->vars_offset);
+    for (uint32_t i = 0; i < hdr->var_count; i++) {
+        g_snapshot.vars[i].name = base + vars[i].key;
+        g_snapshot.vars[i].value = base + vars[i].value;
+        g_snapshot.vars[i].next = i + 1 < hdr->var_count ? &g_snapshot.vars[i + 1] : NULL;
+    }
+    g_shell_vars_head = hdr->var_count ? g_snapshot.vars : NULL;
+
+    StateRecord *history = (StateRecord *)(base + hdr->history_offset);
+    for (uint32_t i = 0; i < hdr->history_count; i++) {
+        g_history.commands[i] = base + history[i].key;
+    }
+    g_history.count = hdr->history_count;
+    g_history.start = 0;
+    g_history.capacity = hdr->history_capacity;
+
+    //the executable cache is only valid under the PATH it was built with
+    if (hdr->path_offset != 0) {
+        char *path_env = base + hdr->path_offset;
+        if (setenv("PATH", path_env, 1) != 0) {
+            perror("wsh: setenv");
+            exit(-1);
+        }
+        pthread_mutex_lock(&g_exec_cache_lock);
+        exec_cache_reset(NULL);
+        g_exec_cache_path = path_env;
+        StateRecord *execs = (StateRecord *)(base + hdr->exec_offset);
+        for (uint32_t i = 0; i < hdr->exec_count; i++) {
+            ExecCacheEntry *entry = &g_snapshot.execs[i];
+            entry->name = base + execs[i].key;
+            entry->path = base + execs[i].value;
+            unsigned bucket = exec_cache_bucket(entry->name);
+            entry->next = g_exec_cache[bucket];
+            g_exec_cache[bucket] = entry;
+        }
+        pthread_mutex_unlock(&g_exec_cache_lock);
+    }
+    return 0;
+}
+
+static void free_state(){
+    if (g_snapshot.base == NULL) {
+        return;
+    }
+    munmap(g_snapshot.base, g_snapshot.size);
+    free(g_snapshot.vars);
+    free(g_snapshot.execs);
+    g_snapshot.base = NULL;
+}
+
+//Arithmetic expansion: $((expr)) is compiled once into postfix form and kept
+//in a hash table under its source text, so a line that runs again only
+//re-evaluates. Integers are 64-bit; names are read from the variable store.
+static const struct {
+    const char *text;
+    int prec;
+} g_arith_binary[] = {
+    [AOP_OR] = {"||", 1}, [AOP_AND] = {"&&", 2}, [AOP_BITOR] = {"|", 3},
+    [AOP_XOR] = {"^", 4}, [AOP_BITAND] = {"&", 5}, [AOP_EQ] = {"==", 6},
+    [AOP_NE] = {"!=", 6}, [AOP_LE] = {"<=", 7}, [AOP_GE] = {">=", 7},
+    [AOP_SHL] = {"<<", 8}, [AOP_SHR] = {">>", 8}, [AOP_LT] = {"<", 7},
+    [AOP_GT] = {">", 7}, [AOP_ADD] = {"+", 9}, [AOP_SUB] = {"-", 9},
+    [AOP_MUL] = {"*", 10}, [AOP_DIV] = {"/", 10}, [AOP_MOD] = {"%", 10},
+};
+#define ARITH_UNARY_PREC 11
+
+static void arith_emit(ArithExpr *expr, ArithOp op, int *cap){
+    if (expr->count == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        expr->ops = realloc(expr->ops, *cap * sizeof(ArithOp));
+        if (expr->ops == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    expr->ops[expr->count++] = op;
+}
+
+//shunting-yard from infix source to postfix ops; returns -1 on a syntax error
+static int arith_compile(const char *src, ArithExpr *expr){
+    int cap = 0;
+    int stack[256];  //pending operators and parentheses
+    int jumps[256];  //for && and ||, the jump that skips their right operand
+    int top = 0;
+    int depth = 0;   //values on the evaluation stack after each op
+    int expect_operand = 1;
+    const char *p = src;
+    expr->ops = NULL;
+    expr->count = 0;
+    expr->depth = 0;
+
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (expect_operand) {
+            if (*p == '(') {
+                stack[top++] = AOP_LPAREN;
+                p++;
+            } else if (*p == '-' || *p == '+' || *p == '!' || *p == '~') {
+                stack[top++] = *p == '-' ? AOP_NEG : *p == '+' ? AOP_PLUS : *p == '!' ? AOP_NOT : AOP_COMPL;
+                p++;
+            } else if (isdigit((unsigned char)*p)) {
+                char *end;
+                errno = 0;
+                ArithOp op = {.kind = ARITH_NUM, .value = (int64_t)strtoull(p, &end, 0)};
+                if (errno != 0 || isalnum((unsigned char)*end)) {
+                    return -1;
+                }
+                arith_emit(expr, op, &cap);
+                p = end;
+                expect_operand = 0;
+            } else if (isalpha((unsigned char)*p) || *p == '_' || *p == '$') {
+                //NAME, $NAME and ${NAME} all name the same variable
+                int braced = p[0] == '$' && p[1] == '{';
+                p += *p == '$' ? 1 + braced : 0;
+                const char *start = p;
+                if (!isalpha((unsigned char)*p) && *p != '_') {
+                    return -1;
+                }
+                while (isalnum((unsigned char)*p) || *p == '_') {
+                    p++;
+                }
+                if (braced && *p++ != '}') {
+                    return -1;
+                }
+                ArithOp op = {.kind = ARITH_VAR, .name = strndup(start, p - braced - start)};
+                if (op.name == NULL) {
+                    perror("strndup");
+                    exit(1);
+                }
+                arith_emit(expr, op, &cap);
+                expect_operand = 0;
+            } else {
+                return -1;
+            }
+            if (!expect_operand && ++depth > expr->depth) {
+                expr->depth = depth;
+            }
+            if (top == (int)(sizeof(stack) / sizeof(stack[0]))) {
+                return -1;
+            }
+            continue;
+        }
+
+        //an operand was just read: a binary operator, ')' or the end follows
+        int op = -1;
+        if (*p != '\0' && *p != ')') {
+            for (int i = 0; i <= AOP_MOD; i++) {
+                size_t len = strlen(g_arith_binary[i].text);
+                if (strncmp(p, g_arith_binary[i].text, len) == 0) {
+                    op = i;
+                    p += len;
+                    break;
+                }
+            }
+            if (op == -1) {
+                return -1;
+            }
+        }
+        //pop everything binding tighter (unary operators always do)
+        while (top > 0 && stack[top - 1] != AOP_LPAREN &&
+               (op == -1 || stack[top - 1] > AOP_MOD || g_arith_binary[stack[top - 1]].prec >= g_arith_binary[op].prec)) {
+            int popped = stack[--top];
+            ArithOp emit = {.kind = popped > AOP_MOD ? ARITH_UNARY : ARITH_BINARY, .op = popped};
+            arith_emit(expr, emit, &cap);
+            depth -= popped > AOP_MOD ? 0 : 1;
+            if (popped == AOP_AND || popped == AOP_OR) {
+                expr->ops[jumps[top]].value = expr->count;
+            }
+        }
+        if (op != -1) {
+            if (top == (int)(sizeof(stack) / sizeof(stack[0]))) {
+                return -1;
+            }
+            if (op == AOP_AND || op == AOP_OR) {
+                //short-circuit: the target is patched once the operator is emitted
+                ArithOp jump = {.kind = ARITH_JUMP, .op = op};
+                jumps[top] = expr->count;
+                arith_emit(expr, jump, &cap);
+            }
+            stack[top++] = op;
+            expect_operand = 1;
+        } else if (*p == ')') {
+            if (top == 0) {
+                return -1;
+            }
+            top--; //the matching '('
+            p++;
+        } else {
+            return top == 0 ? 0 : -1; //end of input with no open '('
+        }
+    }
+}
+
+static void arith_free(ArithExpr *expr){
+    for (int i = 0; i < expr->count; i++) {
+        free(expr->ops[i].name);
+    }
+    free(expr->ops);
+    free(expr->src);
+}
+
+static int arith_eval(ArithExpr *expr, int64_t *result){
+    int64_t stack[expr->depth + 1];
+    int top = 0;
+    for (int i = 0; i < expr->count; i++) {
+        ArithOp *op = &expr->ops[i];
+        if (op->kind == ARITH_NUM) {
+            stack[top++] = op->value;
+            continue;
+        }
+        if (op->kind == ARITH_VAR) {
+            char *value = lookup_var(op->name);
+            stack[top++] = value ? (int64_t)strtoll(value, NULL, 0) : 0;
+            continue;
+        }
+        if (op->kind == ARITH_JUMP) {
+            //the left operand alone decides && and ||, as in C
+            int decided = op->op == AOP_AND ? stack[top - 1] == 0 : stack[top - 1] != 0;
+            if (decided) {
+                stack[top - 1] = op->op == AOP_OR;
+                i = (int)op->value - 1;
+            }
+            continue;
+        }
+        if (op->kind == ARITH_UNARY) {
+            uint64_t a = (uint64_t)stack[top - 1];
+            switch (op->op) {
+                case AOP_NEG: a = -a; break;
+                case AOP_NOT: a = a == 0; break;
+                case AOP_COMPL: a = ~a; break;
+                default: break;
+            }
+            stack[top - 1] = (int64_t)a;
+            continue;
+        }
+
+        //wrapping unsigned math keeps overflow defined
+        int64_t b = stack[--top];
+        int64_t a = stack[top - 1];
+        uint64_t ua = (uint64_t)a;
+        uint64_t ub = (uint64_t)b;
+        int64_t r;
+        switch (op->op) {
+            case AOP_OR: r = a || b; break;
+            case AOP_AND: r = a && b; break;
+            case AOP_BITOR: r = a | b; break;
+            case AOP_XOR: r = a ^ b; break;
+            case AOP_BITAND: r = a & b; break;
+            case AOP_EQ: r = a == b; break;
+            case AOP_NE: r = a != b; break;
+            case AOP_LE: r = a <= b; break;
+            case AOP_GE: r = a >= b; break;
+            case AOP_LT: r = a < b; break;
+            case AOP_GT: r = a > b; break;
+            case AOP_SHL: r = (int64_t)(ua << (ub & 63)); break;
+            case AOP_SHR: r = a >> (ub & 63); break;
+            case AOP_ADD: r = (int64_t)(ua + ub); break;
+            case AOP_SUB: r = (int64_t)(ua - ub); break;
+            case AOP_MUL: r = (int64_t)(ua * ub); break;
+            default:
+                if (b == 0) {
+                    fprintf(stderr, "wsh: %s: division by zero\n", expr->src);
+                    return -1;
+                }
+                if (b == -1) {
+                    r = op->op == AOP_DIV ? (int64_t)(-ua) : 0;
+                } else {
+                    r = op->op == AOP_DIV ? a / b : a % b;
+                }
+                break;
+        }
+        stack[top - 1] = r;
+    }
+    *result = stack[0];
+    return 0;
+}
+
+//compiled expression for src, from the cache when it was seen before
+static ArithExpr *arith_lookup(const char *src){
+    unsigned long hash = 5381;
+    for (const char *p = src; *p != '\0'; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    ArithExpr **bucket = &g_arith_cache[hash % ARITH_CACHE_BUCKETS];
+    for (ArithExpr *expr = *bucket; expr != NULL; expr = expr->next) {
+        if (strcmp(expr->src, src) == 0) {
+            return expr;
+        }
+    }
+
+    ArithExpr *expr = malloc(sizeof(ArithExpr));
+    if (expr == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    expr->src = strdup(src);
+    if (expr->src == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    if (arith_compile(src, expr) == -1 || expr->count == 0) {
+        fprintf(stderr, "wsh: %s: arithmetic syntax error\n", src);
+        arith_free(expr);
+        free(expr);
+        return NULL;
+    }
+    expr->next = *bucket;
+    *bucket = expr;
+    return expr;
+}
+
+static void arith_cache_free(){
+    for (int i = 0; i < ARITH_CACHE_BUCKETS; i++) {
+        ArithExpr *expr = g_arith_cache[i];
+        while (expr != NULL) {
+            ArithExpr *next = expr->next;
+            arith_free(expr);
+            free(expr);
+            expr = next;
+        }
+        g_arith_cache[i] = NULL;
+    }
+}
+
+//replaces each $((expr)) in token by its value. An expression the line split
+//at spaces is joined back from the following strtok tokens. Returns a new
+//string; a failed expression expands to nothing.
+static char *arith_expand_token(char *token){
+    char *joined = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    buf_append(&joined, &len, &cap, token, strlen(token));
+    int open = 0;
+    for (char *p = joined; *p != '\0'; p++) {
+        open += (*p == '(') - (*p == ')');
+    }
+    while (open > 0) {
+        char *next = strtok(NULL, " ");
+        if (next == NULL) {
+            fprintf(stderr, "wsh: %s: missing '))'\n", joined);
+            break;
+        }
+        buf_append(&joined, &len, &cap, " ", 1);
+        buf_append(&joined, &len, &cap, next, strlen(next));
+        for (char *p = next; *p != '\0'; p++) {
+            open += (*p == '(') - (*p == ')');
+        }
+    }
+
+    char *out = NULL;
+    size_t out_len = 0;
+    size_t out_cap = 0;
+    buf_append(&out, &out_len, &out_cap, "", 0);
+    char *p = joined;
+    char *start;
+    while ((start = strstr(p, "$((")) != NULL) {
+        buf_append(&out, &out_len, &out_cap, p, start - p);
+        //the expression ends where the parentheses balance again, on "))"
+        int depth = 0;
+        char *end = start + 1;
+        while (*end != '\0') {
+            depth += (*end == '(') - (*end == ')');
+            if (depth == 0) {
+                break;
+            }
+            end++;
+        }
+        if (*end == '\0' || end[-1] != ')') {
+            p = start + strlen(start);
+            break;
+        }
+        char saved = end[-1];
+        end[-1] = '\0';
+        ArithExpr *expr = arith_lookup(start + 3);
+        end[-1] = saved;
+        int64_t value;
+        if (expr != NULL && arith_eval(expr, &value) == 0) {
+            char digits[32];
+            int n = snprintf(digits, sizeof(digits), "%" PRId64, value);
+            buf_append(&out, &out_len, &out_cap, digits, n);
+        }
+        p = end + 1;
+    }
+    buf_append(&out, &out_len, &out_cap, p, strlen(p));
+    free(joined);
+    return out;
+}
+
+//CPU placement: jobs are pinned by the pin builtin, or round-robined over
+//the allowed cpus by the "placement" shell variable (spread, compact, numa)
+static int parse_cpulist(const char *list, cpu_set_t *set){
+    CPU_ZERO(set);
+    while (*list != '\0' && *list != '\n') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) {
+                return -1;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        list = end;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return 0;
+}
+
+static void topology_load(){
+    if (g_topology.loaded) {
+        return;
+    }
+    g_topology.loaded = 1;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return; //no placement without knowing the usable cpus
+    }
+
+    //node of each cpu; machines without the sysfs node tree are one node
+    g_topology.node_count = 1;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        char path[64];
+        char list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        cpu_set_t node_cpus;
+        if (fgets(list, sizeof(list), f) != NULL && parse_cpulist(list, &node_cpus) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &node_cpus)) {
+                    g_topology.cpu_node[cpu] = node;
+                }
+            }
+            g_topology.node_count = node + 1;
+        }
+        fclose(f);
+    }
+
+    //compact fills one node before the next, spread alternates nodes
+    for (int node = 0; node < g_topology.node_count; node++) {
+        CPU_ZERO(&g_topology.node_cpus[node]);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && g_topology.cpu_node[cpu] == node) {
+                g_topology.compact[g_topology.cpu_count++] = cpu;
+                CPU_SET(cpu, &g_topology.node_cpus[node]);
+            }
+        }
+        if (CPU_COUNT(&g_topology.node_cpus[node]) > 0) {
+            g_topology.nodes[g_topology.used_nodes++] = node;
+        }
+    }
+    int count = 0;
+    for (int round = 0; count < g_topology.cpu_count; round++) {
+        for (int i = 0; i < g_topology.used_nodes; i++) {
+            int seen = 0;
+            for (int j = 0; j < g_topology.cpu_count; j++) {
+                int cpu = g_topology.compact[j];
+                if (g_topology.cpu_node[cpu] == g_topology.nodes[i] && seen++ == round) {
+                    g_topology.spread[count++] = cpu;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void placement_record(Placement *placement){
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &placement->cpus)) {
+            g_topology.cpu_jobs[cpu]++;
+        }
+    }
+    for (int i = 0; i < g_topology.used_nodes; i++) {
+        int node = g_topology.nodes[i];
+        cpu_set_t both;
+        CPU_AND(&both, &placement->cpus, &g_topology.node_cpus[node]);
+        if (CPU_COUNT(&both) > 0) {
+            g_topology.node_jobs[node]++;
+        }
+    }
+}
+
+//picks the cpus for the next job; returns 0 when it should not be placed
+static int placement_next(Placement *placement){
+    placement->node = -1;
+    if (g_pin_cpus != NULL) {
+        topology_load();
+        placement->cpus = *g_pin_cpus;
+        placement_record(placement);
+        return 1;
+    }
+    char *policy = get_shell_var("placement");
+    if (policy == NULL || policy[0] == '\0' || strcmp(policy, "none") == 0) {
+        return 0;
+    }
+    topology_load();
+    if (g_topology.cpu_count == 0) {
+        return 0;
+    }
+
+    CPU_ZERO(&placement->cpus);
+    long next = g_topology.next++;
+    if (strcmp(policy, "spread") == 0) {
+        CPU_SET(g_topology.spread[next % g_topology.cpu_count], &placement->cpus);
+    } else if (strcmp(policy, "compact") == 0) {
+        CPU_SET(g_topology.compact[next % g_topology.cpu_count], &placement->cpus);
+    } else if (strcmp(policy, "numa") == 0) {
+        placement->node = g_topology.nodes[next % g_topology.used_nodes];
+        placement->cpus = g_topology.node_cpus[placement->node];
+    } else {
+        fprintf(stderr, "wsh: placement: unknown policy '%s'\n", policy);
+        g_topology.next--;
+        return 0;
+    }
+    placement_record(placement);
+    return 1;
+}
+
+//bytes execve needs for the environment and for argv, pointers included.
+//An argument longer than MAX_ARG_STRLEN can never be passed, so its size
+//is reported as SIZE_MAX.
+static size_t env_size(){
+    size_t size = sizeof(char *);
+    for (char **env = environ; *env != NULL; env++) {
+        size += strlen(*env) + 1 + sizeof(char *);
+    }
+    return size;
+}
+
+static size_t argv_size(char **args, int argc){
+    size_t size = sizeof(char *);
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(args[i]) + 1;
+        if (len > MAX_ARG_STRLEN) {
+            return SIZE_MAX;
+        }
+        size += len + sizeof(char *);
+    }
+    return size;
+}
+
+//room left for argv when running path: the kernel takes ARG_MAX for the
+//environment, argv and the file name together
+static size_t arg_limit(const char *path){
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t used = env_size() + strlen(path) + 1;
+    if (arg_max <= 0) {
+        arg_max = 128 * 1024; //the historical limit
+    }
+    if ((size_t)arg_max <= used) {
+        return 0;
+    }
+    return (size_t)arg_max - used;
+}
+
+//binds the calling thread (and so any child it spawns) to the placement
+static void placement_apply(Placement *placement){
+    if (sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus) != 0) {
+        perror("wsh: sched_setaffinity");
+    }
+    if (placement->node >= 0) {
+        unsigned long nodemask = 1UL << placement->node;
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, MAX_NUMA_NODES + 1);
+    }
+}
+
+//execute builtin commands
+int execute_vars(){
+    ShellVariable *current = g_shell_vars_head;
+    while (current != NULL) {
+        printf("%s=%s\n", current->name, current->value);
+        current = current->next;
+    }
+    return 0;
+}
+
+int execute_local(char **args, int argc){
+    if (argc != 2) {
+        fprintf(stderr, "local: usage: local VAR=value\n");
+        return -1;
+    }
+    char *arg = args[1];
+    char *equal_sign = strchr(arg, '=');
+    if(equal_sign == NULL) {
+        fprintf(stderr, "local: invalid argument: %s\n", arg);
+        return -1;
+    }
+    //split variable into name and value
+    *equal_sign = '\0';
+    char *name = arg;
+    char *value = equal_sign + 1;
+    if(value[0] == '$'){
+        //set_shell_var copies, so the looked up value is used as is
+        char *var_value = lookup_var(value + 1);
+        value = var_value != NULL ? var_value : "";
+    }
+    int status = set_shell_var(name, value);
+    return status;
+}
+
+int execute_export(char **args, int argc){
+    if (argc != 2) {
+        fprintf(stderr, "export: usage: export VAR=value\n");
+        return -1;
+    }
+    char *arg = args[1];
+    char *equal_sign = strchr(arg, '=');
+    if (equal_sign == NULL) {
+        fprintf(stderr, "export: invalid argument: %s\n", arg);
+        return -1;
+    }
+
+    //split variable into name and value
+    *equal_sign = '\0';
+    char *var = arg;
+    char *value = equal_sign + 1;
+    if (setenv(var, value, 1) != 0) {
+        perror("export");
+        return -1;
+    }
+    return 0;
+}
+
+int execute_cd(char **args, int argc){
+     if(argc < 2){
+        char *home = getenv("HOME");
+        if(home == NULL){
+            fprintf(stderr, "cd: HOME not set\n");
+            return -1;
+        }
+        if(chdir(home) != 0){
+            perror("chdir");
+            return -1;
+        }
+    }else if(argc == 2){
+        if(chdir(args[1]) != 0){
+            perror("cd error");
+            return -1;
+        }
+    }else{
+        fprintf(stderr, "cd: too many arguments\n");
+        return -1;
+    }
+    return 0;
+}
+
+void execute_exit(int argc){
+    if(argc == 1){
+        if(g_state_save_path != NULL){
+            save_state(g_state_save_path);
+        }
+        free_shell_vars();
+        free_history();
+        lookahead_stop();
+        pthread_mutex_lock(&g_exec_cache_lock);
+        exec_cache_reset(NULL);
+        pthread_mutex_unlock(&g_exec_cache_lock);
+        read_buffers_free();
+        arith_cache_free();
+        free_state();
+        return;
+    }
+    fprintf(stderr, "exit: too many arguments\n");
+    g_status = -1;
+    return;
+}
+
+int execute_history(char **args, int argc){
+    if(argc >= 2 && strcmp(args[1], "run") == 0){
+        return execute_history_run(args, argc);
+    }
+    if(argc > 3){
+        fprintf(stderr, "history: too many arguments\n");
+        return -1;
+    }
+    
+    if(argc == 3 && strcmp(args[1], "set") == 0){
+        int size = atoi(args[2]);
+        if(size <= 0 || size > MAX_HISTORY_SIZE){
+            fprintf(stderr, "history: set: invalid size: %s\n", args[2]);
+            return -1;
+        }
+        if(set_history_size(size) == -1){
+            perror("set_history_size");
+            return -1;
+        }
+        return 0;
+    }else if(argc == 2){
+        int command_num = atoi(args[1]);
+        if(command_num <= 0 || command_num > g_history.count){
+            fprintf(stderr, "history: %d: event not found\n", command_num);
+            return -1;
+        }
+        return replay_history(command_num);
+    }else if(argc == 1){
+        for(int i = 0; i < g_history.count; i++){
+            int index = (g_history.start + g_history.count - 1 - i) % g_history.capacity;
+            printf("%d) %s\n", i +1, g_history.commands[index]);
+        }
+    }
+    return 0;
+}
+
+int execute_ls() {
+    DIR *d;
+    struct dirent *dir;
+    char **filenames = NULL;
+    size_t count = 0;
+    size_t capacity = 10;
+    d = opendir(".");
+    if (!d) {
+        perror("ls");
+        return -1;
+    }
     filenames = malloc(capacity * sizeof(char *));
     if (filenames == NULL) {
         perror("malloc");
-        closedir(d);
+        closedir(d);
+        exit(1);
+    }
+    while ((dir = readdir(d)) != NULL) {
+        // ignore "." and ".."
+        if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) {
+            continue;
+        }
+        if (dir->d_name[0] == '.') {
+            continue;
+        }
+        if (count >= capacity) {
+            capacity *= 2;
+            filenames = realloc(filenames, capacity * sizeof(char *));
+            if (filenames == NULL) {
+                perror("realloc");
+                closedir(d);
+                exit(1);
+            }
+        }
+        filenames[count] = strdup(dir->d_name);
+        if (filenames[count] == NULL) {
+            perror("strdup");
+            closedir(d);
+            return -1;
+        }
+
+        count++;
+    }
+    qsort(filenames, count, sizeof(char *), compare);
+
+    for (size_t i = 0; i < count; i++) {
+        printf("%s\n", filenames[i]);
+        free(filenames[i]); 
+    }
+    free(filenames);
+    closedir(d);
+    return 0;
+}
+
+int execute_multi(char **args, int argc){
+    int tag_lines = 0;
+    int i = 1;
+    if (i < argc && strcmp(args[i], "-t") == 0) {
+        tag_lines = 1;
+        i++;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "multi: usage: multi [-t] cmd [args] ::: cmd [args] ...\n");
+        return -1;
+    }
+
+    OutputMux mux;
+    if (mux_init(&mux, tag_lines) == -1) {
+        return -1;
+    }
+    fflush(stdout); //keep earlier builtin output ahead of the children's
+
+    int failed = 0;
+    int job_id = 0;
+    while (i < argc) {
+        //each command runs up to the next ":::" separator
+        int start = i;
+        while (i < argc && strcmp(args[i], ":::") != 0) {
+            i++;
+        }
+        char *separator = args[i];
+        args[i] = NULL;
+        job_id++;
+        if (i > start) {
+            char *path = find_executable(args[start]);
+            if (path == NULL) {
+                fprintf(stderr, "multi: %s: command not found\n", args[start]);
+                failed++;
+            } else if (mux_spawn(&mux, job_id, path, args + start, NULL) == -1) {
+                failed++;
+            }
+            free(path);
+        }
+        args[i] = separator;
+        i++;
+    }
+
+    int id;
+    int status;
+    while (mux_wait(&mux, command_timeout_ms(), &id, &status) == 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    mux_free(&mux);
+    if (mux.timed_out) {
+        return WSH_TIMEOUT_STATUS;
+    }
+    return failed ? -1 : 0;
+}
+
+//runs the command of a prefix builtin (timeout, pin, chunk). The builtin's
+//redirections were already applied to the shell's fds, the child inherits them.
+static void run_external_prefixed(char **args){
+    Redirection no_redir = {.type = REDIR_NONE, .fd = STDOUT_FILENO, .file = NULL};
+    fflush(stdout);
+    execute_external_cmd(args, NULL, 1, &no_redir);
+}
+
+int execute_timeout(char **args, int argc){
+    if (argc < 3) {
+        fprintf(stderr, "timeout: usage: timeout secs cmd [args]\n");
+        return -1;
+    }
+    int timeout_ms;
+    if (parse_duration_ms(args[1], &timeout_ms) == -1) {
+        fprintf(stderr, "timeout: invalid time interval '%s'\n", args[1]);
+        return -1;
+    }
+
+    g_cmd_timeout_ms = timeout_ms == 0 ? -1 : timeout_ms; //0 means no limit
+    run_external_prefixed(args + 2);
+    g_cmd_timeout_ms = -1;
+    return g_status;
+}
+
+int execute_cached(char **args, int argc, Redirection *redir){
+    char dir[PATH_MAX];
+    if (argc < 2) {
+        fprintf(stderr, "cached: usage: cached cmd [args] | cached --stats\n");
+        return -1;
+    }
+    if (cache_dir(dir, sizeof(dir)) == -1) {
+        return -1;
+    }
+    if (argc == 2 && strcmp(args[1], "--stats") == 0) {
+        CacheEntry *entries;
+        int count;
+        long long total;
+        if (cache_scan(dir, &entries, &count, &total) == -1) {
+            return -1;
+        }
+        free(entries);
+        printf("hits: %ld\nmisses: %ld\nentries: %d\nbytes: %lld\n", g_cache_hits, g_cache_misses, count, total);
+        return 0;
+    }
+
+    char *path = find_executable(args[1]);
+    if (path == NULL) {
+        fprintf(stderr, "cached: %s: command not found\n", args[1]);
+        return -1;
+    }
+    char entry[PATH_MAX + 32];
+    snprintf(entry, sizeof(entry), "%s/%016llx", dir, (unsigned long long)cache_key(args + 1, path, redir));
+    fflush(stdout);
+
+    int fd = open(entry, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        CacheHeader hdr;
+        if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == CACHE_MAGIC) {
+            g_cache_hits++;
+            futimens(fd, NULL); //mark as recently used for eviction
+            int status = cache_replay(fd, sizeof(hdr), fd, sizeof(hdr) + hdr.out_len, &hdr);
+            close(fd);
+            free(path);
+            return status;
+        }
+        close(fd);
+    }
+
+    g_cache_misses++;
+    int status = cache_store(entry, path, args + 1);
+    free(path);
+    cache_evict(dir);
+    return status;
+}
+
+//moves len bytes from pipe in_fd to out_fd without copying through user space
+static int splice_all(int in_fd, int out_fd, size_t len){
+    while (len > 0) {
+        ssize_t n = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+//stdin and stdout are both pipes: tee(2) duplicates each chunk into stdout
+//and a scratch pipe per extra file, splice(2) drains them into the files
+static int tee_splice(int *fds, int nfiles){
+    int (*scratch)[2] = malloc((nfiles > 1 ? nfiles - 1 : 1) * sizeof(*scratch));
+    if (scratch == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    //a chunk never exceeds the smallest scratch pipe, so every tee below
+    //duplicates all of it
+    long chunk = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+    int ready = 0;
+    for (; ready < nfiles - 1; ready++) {
+        if (pipe2(scratch[ready], O_CLOEXEC) < 0) {
+            perror("tee: pipe");
+            break;
+        }
+        fcntl(scratch[ready][1], F_SETPIPE_SZ, chunk);
+        long size = fcntl(scratch[ready][1], F_GETPIPE_SZ);
+        if (size < chunk) {
+            chunk = size;
+        }
+    }
+
+    int status = ready == (nfiles > 1 ? nfiles - 1 : 0) ? 0 : -1;
+    while (status == 0) {
+        ssize_t n;
+        if (nfiles == 0) {
+            n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, chunk, SPLICE_F_MOVE);
+        } else {
+            n = tee(STDIN_FILENO, STDOUT_FILENO, chunk, 0);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            status = n == 0 ? 0 : -1;
+            break;
+        }
+        if (nfiles == 0) {
+            continue;
+        }
+        for (int i = 0; i < nfiles - 1 && status == 0; i++) {
+            ssize_t copied;
+            do {
+                copied = tee(STDIN_FILENO, scratch[i][1], n, 0);
+            } while (copied < 0 && errno == EINTR);
+            if (copied != n || splice_all(scratch[i][0], fds[i], n) == -1) {
+                status = -1;
+            }
+        }
+        //the last file consumes the chunk from stdin
+        if (status == 0 && splice_all(STDIN_FILENO, fds[nfiles - 1], n) == -1) {
+            status = -1;
+        }
+    }
+    if (status == -1) {
+        perror("tee");
+    }
+    for (int i = 0; i < ready; i++) {
+        close(scratch[i][0]);
+        close(scratch[i][1]);
+    }
+    free(scratch);
+    return status;
+}
+
+static int tee_copy(int *fds, int nfiles){
+    char *buf = malloc(TEE_BUFFER_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
         exit(1);
     }
-    while ((dir = readdir(d)) != NULL) {
-        // ignore "." and ".."
-        if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) {
-            continue;
-        }
-        if (dir->d_name[0] == '.') {
+    int status = 0;
+    while (1) {
+        ssize_t n = read(STDIN_FILENO, buf, TEE_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) {
             continue;
         }
-        if (count >= capacity) {
-            capacity *= 2;
-            filenames = realloc(filenames, capacity * sizeof(char *));
-            if (filenames == NULL) {
-                perror("realloc");
-                closedir(d);
-                exit(1);
+        if (n <= 0) {
+            if (n < 0) {
+                perror("tee: read");
+                status = -1;
             }
+            break;
         }
-        filenames[count] = strdup(dir->d_name);
-        if (filenames[count] == NULL) {
-            perror("strdup");
-            closedir(d);
+        struct iovec iov = {.iov_base = buf, .iov_len = n};
+        writev_all(STDOUT_FILENO, &iov, 1);
+        for (int i = 0; i < nfiles; i++) {
+            iov.iov_base = buf;
+            iov.iov_len = n;
+            writev_all(fds[i], &iov, 1);
+        }
+    }
+    free(buf);
+    return status;
+}
+
+int execute_tee(char **args, int argc){
+    int append = 0;
+    int i = 1;
+    if (i < argc && strcmp(args[i], "-a") == 0) {
+        append = 1;
+        i++;
+    }
+
+    int nfiles = argc - i;
+    int *fds = malloc((nfiles > 0 ? nfiles : 1) * sizeof(int));
+    if (fds == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int j = 0; j < nfiles; j++) {
+        //splice refuses O_APPEND targets, so append by seeking to the end
+        fds[j] = open(args[i + j], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+        if (fds[j] < 0) {
+            perror("tee: open");
+            while (--j >= 0) {
+                close(fds[j]);
+            }
+            free(fds);
             return -1;
         }
+        if (append) {
+            lseek(fds[j], 0, SEEK_END);
+        }
+    }
+    fflush(stdout);
+
+    struct stat in_st;
+    struct stat out_st;
+    int status;
+    if (fstat(STDIN_FILENO, &in_st) == 0 && fstat(STDOUT_FILENO, &out_st) == 0
+            && S_ISFIFO(in_st.st_mode) && S_ISFIFO(out_st.st_mode)) {
+        status = tee_splice(fds, nfiles);
+    } else {
+        status = tee_copy(fds, nfiles);
+    }
+    for (int j = 0; j < nfiles; j++) {
+        close(fds[j]);
+    }
+    free(fds);
+    return status;
+}
 
+//replaces every {} in arg with item
+static char *substitute_item(const char *arg, const char *item, size_t item_len){
+    size_t count = 0;
+    for (const char *p = strstr(arg, "{}"); p != NULL; p = strstr(p + 2, "{}")) {
         count++;
     }
-    qsort(filenames, count, sizeof(char *), compare);
+    char *result = malloc(strlen(arg) + count * item_len + 1);
+    if (result == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    char *out = result;
+    const char *p;
+    while ((p = strstr(arg, "{}")) != NULL) {
+        memcpy(out, arg, p - arg);
+        out += p - arg;
+        memcpy(out, item, item_len);
+        out += item_len;
+        arg = p + 2;
+    }
+    strcpy(out, arg);
+    return result;
+}
 
-    for (size_t i = 0; i < count; i++) {
-        printf("%s\n", filenames[i]);
-        free(filenames[i]); 
+static void report_parallel_failure(long item_no, const char *item, int status){
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "parallel: item %ld failed (signal %d): %s\n", item_no, WTERMSIG(status), item);
+    } else {
+        fprintf(stderr, "parallel: item %ld failed (exit %d): %s\n", item_no, WEXITSTATUS(status), item);
     }
-    free(filenames);
-    closedir(d);
+}
+
+int execute_parallel(char **args, int argc){
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > MAX_PARALLEL_JOBS) {
+        jobs = MAX_PARALLEL_JOBS;
+    }
+    int tag_lines = 0;
+    int i = 1;
+    while (i < argc && args[i][0] == '-') {
+        if (strcmp(args[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atol(args[i + 1]);
+            i += 2;
+        } else if (strcmp(args[i], "-t") == 0) {
+            tag_lines = 1;
+            i++;
+        } else {
+            break;
+        }
+    }
+    if (i >= argc || jobs <= 0) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] [-t] cmd [args with {}] < list\n");
+        return -1;
+    }
+    if (jobs > MAX_PARALLEL_JOBS) {
+        fprintf(stderr, "parallel: -j %ld: at most %d jobs can run at once\n", jobs, MAX_PARALLEL_JOBS);
+        return -1;
+    }
+
+    //resolved once, every item spawns the same executable
+    char **cmd = args + i;
+    int cmd_argc = argc - i;
+    char *path = find_executable(cmd[0]);
+    if (path == NULL) {
+        fprintf(stderr, "parallel: %s: command not found\n", cmd[0]);
+        return -1;
+    }
+    int has_placeholder = 0;
+    for (int k = 0; k < cmd_argc; k++) {
+        has_placeholder |= strstr(cmd[k], "{}") != NULL;
+    }
+
+    char **child_args = malloc((cmd_argc + 2) * sizeof(char *));
+    long *ids = calloc(jobs, sizeof(long));   //item number per in-flight slot, 0 if free
+    char **items = calloc(jobs, sizeof(char *));
+    if (child_args == NULL || ids == NULL || items == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    OutputMux mux;
+    if (mux_init(&mux, tag_lines) == -1) {
+        free(child_args);
+        free(ids);
+        free(items);
+        free(path);
+        return -1;
+    }
+
+    //children must not eat the item list the shell is reading
+    Redirection devnull = {.type = REDIR_INPUT, .fd = STDIN_FILENO, .file = "/dev/null"};
+    LineReader reader;
+    line_reader_init(&reader, STDIN_FILENO);
+    fflush(stdout);
+
+    long item_no = 0;
+    long failed = 0;
+    long running = 0;
+    while (1) {
+        size_t len;
+        //no new items once the deadline has killed the running ones
+        char *item = running < jobs && !mux.timed_out ? line_reader_next(&reader, &len) : NULL;
+        if (item != NULL) {
+            if (len == 0) {
+                continue; //blank lines are not items
+            }
+            item_no++;
+            for (int k = 0; k < cmd_argc; k++) {
+                child_args[k] = has_placeholder ? substitute_item(cmd[k], item, len) : cmd[k];
+            }
+            child_args[cmd_argc] = has_placeholder ? NULL : item;
+            child_args[cmd_argc + 1] = NULL;
+
+            long slot = 0;
+            while (ids[slot] != 0) {
+                slot++;
+            }
+            if (mux_spawn(&mux, (int)item_no, path, child_args, &devnull) == -1) {
+                fprintf(stderr, "parallel: item %ld failed to start: %s\n", item_no, item);
+                failed++;
+            } else {
+                ids[slot] = item_no;
+                items[slot] = strdup(item);
+                running++;
+            }
+            for (int k = 0; has_placeholder && k < cmd_argc; k++) {
+                free(child_args[k]);
+            }
+            continue;
+        }
+
+        //out of free slots or items: reap whichever child finishes first
+        int id;
+        int status;
+        if (running == 0 || mux_wait(&mux, command_timeout_ms(), &id, &status) == -1) {
+            break;
+        }
+        running--;
+        long slot = 0;
+        while (ids[slot] != id) {
+            slot++;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            report_parallel_failure(id, items[slot], status);
+            failed++;
+        }
+        free(items[slot]);
+        ids[slot] = 0;
+    }
+
+    if (failed > 0) {
+        fprintf(stderr, "parallel: %ld of %ld items failed\n", failed, item_no);
+    }
+    line_reader_free(&reader);
+    mux_free(&mux);
+    free(child_args);
+    free(ids);
+    free(items);
+    free(path);
+    if (mux.timed_out) {
+        return WSH_TIMEOUT_STATUS;
+    }
+    return failed ? -1 : 0;
+}
+
+//read [-u fd] VAR [VAR...], assigns the words of one input line to the
+//variables, the last one taking the rest of the line
+int execute_read(char **args, int argc){
+    int fd = STDIN_FILENO;
+    int i = 1;
+    if (argc > 2 && strcmp(args[1], "-u") == 0) {
+        char *end;
+        fd = (int)strtol(args[2], &end, 10);
+        if (*end != '\0' || end == args[2] || fd < 0 || fd >= READ_MAX_FD) {
+            fprintf(stderr, "read: %s: invalid file descriptor\n", args[2]);
+            return -1;
+        }
+        i = 3;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "read: usage: read [-u fd] VAR [VAR...]\n");
+        return -1;
+    }
+
+    char *line;
+    size_t len;
+    char *stdio_line = NULL;
+    char *unbuffered_line = NULL;
+    LineReader *reader = NULL;
+    if (fd == STDIN_FILENO && g_input_stream == stdin) {
+        //commands come from stdin too, share stdio's buffer with run_loop
+        size_t cap = 0;
+        ssize_t n = getline(&stdio_line, &cap, stdin);
+        line = stdio_line;
+        len = n > 0 ? (size_t)n : 0;
+        if (n > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (n == -1) {
+            line = NULL;
+        }
+    } else if (lseek(fd, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+        line_reader_free(&g_read_buffers[fd].reader);
+        unbuffered_line = read_unbuffered_line(fd, &len);
+        line = unbuffered_line;
+    } else {
+        reader = read_buffer_get(fd);
+        if (reader == NULL) {
+            fprintf(stderr, "read: %d: %s\n", fd, strerror(errno));
+            return -1;
+        }
+        line = line_reader_next(reader, &len);
+    }
+
+    //split in place: values are copied once, straight from the line buffer
+    char *p = line;
+    char *end = line ? line + len : NULL;
+    for (; i < argc; i++) {
+        while (p != NULL && p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        char *word = p;
+        if (p != NULL && i < argc - 1) {
+            while (p < end && *p != ' ' && *p != '\t') {
+                p++;
+            }
+        } else if (p != NULL) {
+            p = end;
+            while (p > word && (p[-1] == ' ' || p[-1] == '\t')) {
+                p--;
+            }
+        }
+        if (set_shell_var_n(args[i], word ? word : "", word ? (size_t)(p - word) : 0) == -1) {
+            break;
+        }
+    }
+
+    if (reader != NULL) {
+        read_buffer_release(fd);
+    }
+    free(stdio_line);
+    free(unbuffered_line);
+    return line == NULL ? -1 : 0;
+}
+
+//resident set size of the shell from /proc/self/statm, -1 if unknown
+static long resident_kb(){
+    long pages = -1;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return -1;
+    }
+    if (fscanf(statm, "%*d %ld", &pages) != 1) {
+        pages = -1;
+    }
+    fclose(statm);
+    return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+//memstats prints resident memory and, in MEMSTATS builds, the live
+//allocations of each subsystem
+int execute_memstats(int argc){
+    if (argc != 1) {
+        fprintf(stderr, "memstats: usage: memstats\n");
+        return -1;
+    }
+    printf("rss: %ld kB\n", resident_kb());
+#ifdef WSH_MEMSTATS
+    static const char *names[MEM_SUBSYSTEMS] = {
+        [MEM_SHELL] = "shell", [MEM_PARSER] = "parser", [MEM_HISTORY] = "history",
+        [MEM_VARIABLES] = "variables", [MEM_BUILTINS] = "builtins", [MEM_EXEC] = "exec",
+    };
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        printf("%s: %ld bytes in %ld blocks, %ld allocations\n", names[i],
+               __atomic_load_n(&g_mem_live_bytes[i], __ATOMIC_RELAXED),
+               __atomic_load_n(&g_mem_live_allocs[i], __ATOMIC_RELAXED),
+               __atomic_load_n(&g_mem_total_allocs[i], __ATOMIC_RELAXED));
+    }
+#endif
     return 0;
 }
 
+//pin cpulist cmd [args] | pin (print placement counters)
+int execute_pin(char **args, int argc){
+    if (argc == 1) {
+        topology_load();
+        for (int i = 0; i < g_topology.cpu_count; i++) {
+            int cpu = g_topology.compact[i];
+            if (g_topology.cpu_jobs[cpu] > 0) {
+                printf("cpu %d: %ld\n", cpu, g_topology.cpu_jobs[cpu]);
+            }
+        }
+        for (int i = 0; i < g_topology.used_nodes; i++) {
+            int node = g_topology.nodes[i];
+            if (g_topology.node_jobs[node] > 0) {
+                printf("node %d: %ld\n", node, g_topology.node_jobs[node]);
+            }
+        }
+        return 0;
+    }
+    cpu_set_t cpus;
+    if (argc < 3 || parse_cpulist(args[1], &cpus) == -1 || CPU_COUNT(&cpus) == 0) {
+        fprintf(stderr, "pin: usage: pin cpulist cmd [args], e.g. pin 0-3,8 make\n");
+        return -1;
+    }
+
+    g_pin_cpus = &cpus;
+    run_external_prefixed(args + 2);
+    g_pin_cpus = NULL;
+    return g_status;
+}
+
+//chunk [-j N] [-n max] cmd [args] [::: items], runs cmd over the items in as
+//few invocations as ARG_MAX allows, like xargs; without ::: every argument
+//after cmd is an item
+int execute_chunk(char **args, int argc){
+    long jobs = 1;
+    long max_items = 0;
+    int i = 1;
+    while (i + 1 < argc && args[i][0] == '-') {
+        if (strcmp(args[i], "-j") == 0) {
+            jobs = atol(args[i + 1]);
+        } else if (strcmp(args[i], "-n") == 0) {
+            max_items = atol(args[i + 1]);
+        } else {
+            break;
+        }
+        i += 2;
+    }
+    if (i >= argc || jobs <= 0 || max_items < 0) {
+        fprintf(stderr, "chunk: usage: chunk [-j N] [-n max] cmd [args] [::: items]\n");
+        return -1;
+    }
+    if (jobs > MAX_PARALLEL_JOBS) {
+        fprintf(stderr, "chunk: -j %ld: at most %d jobs can run at once\n", jobs, MAX_PARALLEL_JOBS);
+        return -1;
+    }
+
+    int fixed = 1;
+    int first_item = i + 1;
+    for (int k = i + 1; k < argc; k++) {
+        if (strcmp(args[k], ":::") == 0) {
+            fixed = k - i;
+            first_item = k + 1;
+            break;
+        }
+    }
+    char **child_args = malloc((fixed + argc + 1) * sizeof(char *));
+    if (child_args == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(child_args, args + i, fixed * sizeof(char *));
+    char *path = find_executable(child_args[0]);
+    if (path == NULL) {
+        fprintf(stderr, "chunk: %s: command not found\n", child_args[0]);
+        free(child_args);
+        return -1;
+    }
+    size_t limit = arg_limit(path);
+    size_t base = argv_size(child_args, fixed);
+    if (base > limit) {
+        fprintf(stderr, "chunk: %s: argument too long for a single command line\n", child_args[0]);
+        free(child_args);
+        free(path);
+        return -1;
+    }
+
+    OutputMux mux;
+    if (jobs > 1) {
+        if (mux_init(&mux, 0) == -1) {
+            free(child_args);
+            free(path);
+            return -1;
+        }
+    }
+    fflush(stdout);
+
+    int failed = 0;
+    int timed_out = 0;
+    int running = 0;
+    int chunk_no = 0;
+    int next = first_item;
+    do {
+        //fill the command line up to the byte limit or the -n count
+        int count = fixed;
+        size_t size = base;
+        while (next < argc && (max_items == 0 || count - fixed < max_items)) {
+            size_t item = strlen(args[next]) + 1 + sizeof(char *);
+            int too_long = item - sizeof(char *) > MAX_ARG_STRLEN;
+            if ((size + item > limit || too_long) && count > fixed) {
+                break;
+            }
+            size += item;
+            child_args[count++] = args[next++];
+            if (too_long) {
+                size = SIZE_MAX; //execve can never take it, so it goes alone
+                break;
+            }
+        }
+        child_args[count] = NULL;
+        if (size > limit) {
+            fprintf(stderr, "chunk: %s: argument too long for a single command line\n", child_args[0]);
+            failed++;
+            continue;
+        }
+        chunk_no++;
+
+        if (jobs == 1) {
+            run_external_prefixed(child_args);
+            failed += g_status != 0;
+            timed_out = g_status == WSH_TIMEOUT_STATUS;
+            continue;
+        }
+        int id;
+        int status;
+        if (running == jobs && mux_wait(&mux, command_timeout_ms(), &id, &status) == 0) {
+            running--;
+            failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+        if (mux.timed_out) {
+            timed_out = 1;
+            continue;
+        }
+        if (mux_spawn(&mux, chunk_no, path, child_args, NULL) == -1) {
+            failed++;
+        } else {
+            running++;
+        }
+    } while (next < argc && !timed_out);
+
+    if (jobs > 1) {
+        int id;
+        int status;
+        while (mux_wait(&mux, command_timeout_ms(), &id, &status) == 0) {
+            failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+        mux_free(&mux);
+        timed_out |= mux.timed_out;
+    }
+    free(child_args);
+    free(path);
+    if (timed_out) {
+        return WSH_TIMEOUT_STATUS;
+    }
+    return failed ? -1 : 0;
+}
+
 //Main functions
 void execute_external_cmd(char **args, char *command_str, int from_history, Redirection *redir){
     pid_t pid; // pid of the child process
-    pid_t wpid;
     int status;
-    char *path_env = getenv("PATH");
+    int timed_out = 0;
     char *path = NULL;
     int saved_stdout = -1;
     int saved_stdin = -1;
     int saved_stderr = -1;
     int fd;
 
-    if (!path_env) {
-        path_env = "/bin";
+    path = find_executable(args[0]);
+    if(path == NULL) {
+        g_status = -1;
+        return;
     }
 
-    //get the list of directories from PATH
-    char *token = strtok(path_env, ":");
-    while (token != NULL) {
-        path = malloc(strlen(token) + strlen(args[0]) + 2); 
-        if (!path) {
-            perror("malloc");
-            g_status = -1;
-            exit(1);
-        }
-
-        //construct the path to executable
-        sprintf(path, "%s/%s", token, args[0]);
-
-        //check if the file exists
-        if(access(path, X_OK) == 0) {
-            break;  //found 
-        }
+    //refuse before forking rather than let execv fail with E2BIG
+    int arg_count = 0;
+    while (args[arg_count] != NULL) {
+        arg_count++;
+    }
+    size_t size = argv_size(args, arg_count);
+    if (size == SIZE_MAX) {
+        fprintf(stderr, "wsh: %s: argument too long\n", args[0]);
         free(path);
-        path = NULL;
-        token = strtok(NULL, ":");
+        g_status = -1;
+        return;
     }
-
-    if(path == NULL) {
+    if (size > arg_limit(path)) {
+        fprintf(stderr, "wsh: %s: argument list too long, run it as 'chunk %s ...'\n", args[0], args[0]);
+        free(path);
         g_status = -1;
         return;
     }
+    Placement placement;
+    int placed = placement_next(&placement);
 
     //fork  child process
     pid = fork();
     if (pid == 0) {
+        if (placed) {
+            placement_apply(&placement);
+        }
         //child process: handle redirection before executing the command
         if (redir->type != REDIR_NONE){
             if (redir->type == REDIR_OUTPUT || redir->type == REDIR_OUTPUT_APPEND) {
                 fd = open(redir->file, O_WRONLY | O_CREAT | (redir->type == REDIR_OUTPUT_APPEND ? O_APPEND : O_TRUNC), 0644);
                 if (fd < 0) {
                     perror("open");
-                    g_status = -1;
-                    return;
+                    _exit(1); //never return into the shell's loop from the child
                 }
                 //save current stdout
                 saved_stdout = dup(STDOUT_FILENO);
@@ -624,32 +3762,28 @@ void execute_external_cmd(char **args, char *command_str, int from_history, Redi
                 if (dup2(fd, redir->fd) < 0) {
                     perror("dup2");
                     close(fd);
-                    g_status = -1;
-                    return;
+                    _exit(1);
                 }
                 close(fd);
-            } else if(redir->type == REDIR_INPUT) {
-                fd = open(redir->file, O_RDONLY);
+            } else if(is_input_redirection(redir->type)) {
+                fd = open_input_redirection(redir);
                 if (fd < 0) {
                     perror("open");
-                    g_status = -1;
-                    return;
+                    _exit(1);
                 }
                 //save current stdin for later
                 saved_stdin = dup(STDIN_FILENO);
                 if(dup2(fd, redir->fd) < 0) {
                     perror("dup2");
                     close(fd);
-                    g_status = -1;
-                    return;
+                    _exit(1);
                 }
                 close(fd);
             } else if (redir->type == REDIR_OUTPUT_ERROR || redir->type == REDIR_OUTPUT_ERROR_APPEND) {
                 fd = open(redir->file, O_WRONLY | O_CREAT | (redir->type == REDIR_OUTPUT_ERROR_APPEND ? O_APPEND : O_TRUNC), 0644);
                 if(fd < 0) {
                     perror("open");
-                    g_status = -1;
-                    return;
+                    _exit(1);
                 }
                 //save current stdout and stderr
                 saved_stdout = dup(STDOUT_FILENO);
@@ -657,40 +3791,34 @@ void execute_external_cmd(char **args, char *command_str, int from_history, Redi
                 if (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
                     perror("dup2");
                     close(fd);
-                    g_status = -1;
-                    return;
+                    _exit(1);
                 }
                 close(fd); 
             }
         }
         
-        if(execv(path, args) == -1) {
-            perror("wsh");
-            g_status = -1; 
-            //exit(g_status);
-            return;
-        }
+        execv(path, args);
+        perror("wsh");
+        _exit(127); //as for a command that is not found
     }else if(pid < 0) {
         //fork failed
         perror("wsh: fork");
         g_status = -1;
         return;
     }else{
-        //parent process waits for the child to complete
-        while (1) {
-            wpid = waitpid(pid, &status, WUNTRACED);
-            if(wpid == -1) {
-                perror("waitpid");
-                g_status = -1;
-                return;
-            }
-            if(WIFEXITED(status) || WIFSIGNALED(status)) {
-                break;
-            }
+        //parent process waits for the child to complete, bounded by the
+        //timeout builtin and the script deadline when either is set
+        timed_out = wait_child(pid, command_timeout_ms(), &status);
+        if(timed_out == -1) {
+            g_status = -1;
+            return;
         }
     }
     if(!from_history) {
-        if(add_to_history(command_str) == -1){
+        MemSubsystem previous = mem_enter(MEM_HISTORY);
+        int added = add_to_history(command_str);
+        mem_leave(previous);
+        if(added == -1){
             g_status = -1;
             return;
         }
@@ -710,7 +3838,7 @@ void execute_external_cmd(char **args, char *command_str, int from_history, Redi
         dup2(saved_stdin, STDIN_FILENO);
         close(saved_stdin);
     }
-    g_status = 0; //success
+    g_status = timed_out ? WSH_TIMEOUT_STATUS : 0; //success unless killed
     return;
 }
 
@@ -739,8 +3867,8 @@ void execute_builtin_cmd(builtin_cmd_t cmd, char **args, int argc, Redirection *
                 return;
             }
             close(fd);
-        } else if (redir->type == REDIR_INPUT) {
-            fd = open(redir->file, O_RDONLY);
+        } else if (is_input_redirection(redir->type)) {
+            fd = open_input_redirection(redir);
             if (fd < 0) {
                 perror("open");
                 g_status = -1;
@@ -796,6 +3924,33 @@ void execute_builtin_cmd(builtin_cmd_t cmd, char **args, int argc, Redirection *
         case CMD_LS:
             g_status = execute_ls();
             break;
+        case CMD_MULTI:
+            g_status = execute_multi(args, argc);
+            break;
+        case CMD_TIMEOUT:
+            g_status = execute_timeout(args, argc);
+            break;
+        case CMD_CACHED:
+            g_status = execute_cached(args, argc, redir);
+            break;
+        case CMD_TEE:
+            g_status = execute_tee(args, argc);
+            break;
+        case CMD_PARALLEL:
+            g_status = execute_parallel(args, argc);
+            break;
+        case CMD_PIN:
+            g_status = execute_pin(args, argc);
+            break;
+        case CMD_CHUNK:
+            g_status = execute_chunk(args, argc);
+            break;
+        case CMD_READ:
+            g_status = execute_read(args, argc);
+            break;
+        case CMD_MEMSTATS:
+            g_status = execute_memstats(argc);
+            break;
         default:
             break;
     }
@@ -825,14 +3980,22 @@ void run_loop(FILE *input_stream){
 
     //begin prompt loop 
     while(1){
+        if(g_deadline_ms != 0 && deadline_remaining_ms() == 0){
+            fprintf(stderr, "wsh: deadline exceeded\n");
+            g_status = WSH_TIMEOUT_STATUS;
+            break;
+        }
         if(input_stream == stdin){
             printf("wsh> ");
             fflush(stdout);
         }
+        MemSubsystem previous = mem_enter(MEM_PARSER);
         line = read_line(input_stream);
+        mem_leave(previous);
         if(line == NULL){
             break; //EOF
         }
+        lookahead_advance();
         char* trimmed_line = trim(line);
 
         if(trimmed_line[0] == '#' || trimmed_line[0] == '\0'){
@@ -849,10 +4012,19 @@ void run_loop(FILE *input_stream){
             return;
         }
 
+        previous = mem_enter(MEM_PARSER);
         parsed_command = parse_line(trimmed_line, &argc, &redir);
+        if(redir.type == REDIR_HEREDOC){
+            read_heredoc(input_stream, &redir);
+        }
+        mem_leave(previous);
         builtin_cmd_t command = get_builtin_command(parsed_command[0]);
 
-        if(command == CMD_EXIT){
+        if(redir.invalid){
+            //the body has been consumed, the command itself is not run
+            free(command_str_copy);
+            g_status = -1;
+        }else if(command == CMD_EXIT){
             //free before exit
             execute_exit(argc);
             for(int i =0; i < argc; i++) {
@@ -863,11 +4035,15 @@ void run_loop(FILE *input_stream){
             free(line);
             exit(g_status);
         }else if(command == NOT_BUILT_IN){
+            previous = mem_enter(MEM_EXEC);
             execute_external_cmd(parsed_command,command_str_copy, 0, &redir);
+            mem_leave(previous);
             free(command_str_copy);
         }else{
             free(command_str_copy);
+            previous = mem_enter(MEM_BUILTINS);
             execute_builtin_cmd(command, parsed_command, argc, &redir);
+            mem_leave(previous);
         }
 
         //free each token
@@ -875,6 +4051,8 @@ void run_loop(FILE *input_stream){
             free(parsed_command[i]);
         }
         free(parsed_command);
+        free(redir.file);
+        free(redir.data);
         free(line);
     }
     return;
@@ -882,12 +4060,29 @@ void run_loop(FILE *input_stream){
 
 int main(int argc, char* argv[]){
     FILE *input_stream = stdin; //default is interactive mode
-    if(argc > 2){
-        printf("Usage: %s <script_file>\n", argv[0]);
-        exit(-1);
+    char *script = NULL;
+    char *load_path = NULL;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--deadline") == 0 && i + 1 < argc){
+            int deadline_ms;
+            if(parse_duration_ms(argv[++i], &deadline_ms) == -1){
+                fprintf(stderr, "wsh: invalid deadline: %s\n", argv[i]);
+                exit(-1);
+            }
+            g_deadline_ms = deadline_ms == 0 ? 0 : monotonic_ms() + deadline_ms;
+        }else if(strcmp(argv[i], "--save-state") == 0 && i + 1 < argc){
+            g_state_save_path = argv[++i];
+        }else if(strcmp(argv[i], "--load-state") == 0 && i + 1 < argc){
+            load_path = argv[++i];
+        }else if(script == NULL){
+            script = argv[i];
+        }else{
+            printf("Usage: %s [--deadline secs] [--save-state file] [--load-state file] <script_file>\n", argv[0]);
+            exit(-1);
+        }
     }
-    if(argc == 2){ //batch mode
-        input_stream = fopen(argv[1], "r");
+    if(script != NULL){ //batch mode
+        input_stream = fopen(script, "r");
         if(input_stream == NULL){
             perror("Input stream is NULL");
             exit(-1);
@@ -900,10 +4095,23 @@ int main(int argc, char* argv[]){
         exit(-1);
     }
 
-    init_history();
+    if(load_path == NULL){
+        init_history();
+    }else if(load_state(load_path) == -1){
+        exit(-1);
+    }
+    if(script != NULL){
+        lookahead_start(script);
+    }
 
+    g_input_stream = input_stream;
     run_loop(input_stream); //main program loop
 
+    lookahead_stop();
+    if(g_state_save_path != NULL){
+        save_state(g_state_save_path);
+    }
+
     if(input_stream != stdin){
         fclose(input_stream);
     }
@@ -1,6 +1,7 @@
 #ifndef WSH_SHELL_H
 #define WSH_SHELL_H
 
+#define _GNU_SOURCE     //pipe2, pidfd and other linux extensions
 #include <stdio.h>      
 #include <stdlib.h>     
 #include <string.h>     //string functions(strcpy, strlen, strcmp,...)
@@ -10,6 +11,70 @@
 #include <sys/wait.h>   //wait on child processes (wait, waitpid)
 #include <dirent.h>     //directory operations (opendir, readdir, closedir)
 #include <fcntl.h>      //file control (open, O_RDONLY, O_WRONLY)
+#include <errno.h>      //errno values (EAGAIN, EINTR)
+#include <signal.h>     //kill, SIGTERM, SIGKILL
+#include <spawn.h>      //posix_spawn for multiplexed children
+#include <sys/epoll.h>  //event loop over child pipes and pidfds
+#include <sys/syscall.h>//raw syscalls (pidfd_open)
+#include <sys/uio.h>    //writev for tagged output lines
+#include <sys/socket.h> //recv MSG_PEEK for the read builtin
+#include <poll.h>       //poll on a pidfd for timed waits
+#include <time.h>       //clock_gettime for deadlines
+#include <stdint.h>     //fixed width fields of cache entries
+#include <inttypes.h>   //PRId64 for arithmetic results
+#include <limits.h>     //PATH_MAX
+#include <sys/stat.h>   //file identity for cache keys, mkdir
+#include <sys/sendfile.h> //zero-copy replay of cached output
+#include <pthread.h>    //batch lookahead thread
+#include <fnmatch.h>    //history run --match patterns
+#include <sched.h>      //sched_setaffinity for job placement
+#include <linux/mempolicy.h> //MPOL_PREFERRED for numa placement
+#include <sys/mman.h>   //memfd_create for here-documents, mmap of state files
+#include <stddef.h>     //max_align_t for allocation headers
+
+//Subsystems the memstats builtin reports allocations for
+typedef enum {
+    MEM_SHELL,      //startup and anything not attributed below
+    MEM_PARSER,
+    MEM_HISTORY,
+    MEM_VARIABLES,
+    MEM_BUILTINS,
+    MEM_EXEC,
+    MEM_SUBSYSTEMS
+} MemSubsystem;
+
+#ifdef WSH_MEMSTATS
+//make MEMSTATS=1: every allocation in wsh.c carries a header naming its
+//subsystem and size, so live bytes can be counted per subsystem
+typedef union MemHeader {
+    struct {
+        size_t size;
+        MemSubsystem subsystem;
+    } info;
+    max_align_t align;
+} MemHeader;
+
+static void *wsh_malloc(size_t size);
+static void *wsh_calloc(size_t count, size_t size);
+static void *wsh_realloc(void *ptr, size_t size);
+static void wsh_free(void *ptr);
+static char *wsh_copy(const char *s, size_t len);
+static char *wsh_strdup(const char *s);
+static char *wsh_strndup(const char *s, size_t n);
+static ssize_t wsh_getline(char **lineptr, size_t *n, FILE *stream);
+static MemSubsystem mem_enter(MemSubsystem subsystem);
+static void mem_leave(MemSubsystem previous);
+#define malloc(size) wsh_malloc(size)
+#define calloc(count, size) wsh_calloc(count, size)
+#define realloc(ptr, size) wsh_realloc(ptr, size)
+#define free(ptr) wsh_free(ptr)
+#define strdup(s) wsh_strdup(s)
+#define strndup(s, n) wsh_strndup(s, n)
+#define getline(lineptr, n, stream) wsh_getline(lineptr, n, stream)
+#else
+#define mem_enter(subsystem) MEM_SHELL
+#define mem_leave(previous) ((void)(previous))
+#endif
 
 typedef enum {
     REDIR_NONE,
@@ -17,13 +82,18 @@ typedef enum {
     REDIR_OUTPUT,              // >
     REDIR_OUTPUT_APPEND,       // >>
     REDIR_OUTPUT_ERROR,        // &>
-    REDIR_OUTPUT_ERROR_APPEND  // &>>
+    REDIR_OUTPUT_ERROR_APPEND, // &>>
+    REDIR_HEREDOC,             // <<EOF
+    REDIR_HERESTRING           // <<<word
 } RedirectionType;
 
 typedef struct Redirection {
     RedirectionType type;
     int fd;       //file descriptor number
-    char *file;   //target file
+    char *file;   //target file, or the here-document delimiter
+    char *data;   //here-document/here-string contents
+    size_t data_len;
+    int invalid;  //syntax error, e.g. a here-document mixed with another redirection
 } Redirection;
 
 typedef enum {
@@ -34,11 +104,27 @@ typedef enum {
     CMD_VARS,
     CMD_HISTORY,
     CMD_LS,
+    CMD_MULTI,
+    CMD_TIMEOUT,
+    CMD_CACHED,
+    CMD_TEE,
+    CMD_PARALLEL,
+    CMD_PIN,
+    CMD_CHUNK,
+    CMD_READ,
+    CMD_MEMSTATS,
     NOT_BUILT_IN
 } builtin_cmd_t;
 
+typedef struct ParsedCommand {
+    char **args;       //NULL until the entry is first replayed
+    int argc;
+    Redirection redir;
+} ParsedCommand;
+
 typedef struct History {
     char **commands; //dynamically allocated 
+    ParsedCommand *parsed; //cached parse of each command, same indexing
     int count;
     int start;
     int capacity;
@@ -50,6 +136,152 @@ typedef struct ShellVariable {
     struct ShellVariable *next;
 } ShellVariable;
 
+typedef struct MuxJob {
+    int id;          //job tag printed as "[id] "
+    pid_t pid;       //0 when the slot is free
+    int pidfd;       //becomes readable when the child exits
+    int fds[2];      //read ends of the child's stdout/stderr, -1 once drained
+    char *bufs[2];   //pending partial line per stream
+    size_t lens[2];
+    int exited;
+    int status;      //wait status once exited
+} MuxJob;
+
+typedef struct OutputMux {
+    int epfd;
+    int tag_lines;   //prefix every line with the job tag
+    MuxJob *jobs;    //slots are reused once a job completes
+    int capacity;
+    int running;
+    int timed_out;       //the timeout passed and the jobs were signalled
+    long long kill_at;   //when SIGKILL follows SIGTERM, 0 if not pending
+} OutputMux;
+
+typedef struct CacheHeader {
+    uint32_t magic;
+    int32_t status;   //wait status of the original run
+    uint64_t out_len; //stdout bytes follow the header, then stderr
+    uint64_t err_len;
+} CacheHeader;
+
+typedef struct CacheEntry {
+    char name[17];
+    off_t size;
+    struct timespec used; //mtime, refreshed on every hit
+} CacheEntry;
+
+typedef struct ExecCacheEntry {
+    char *name;
+    char *path;
+    struct ExecCacheEntry *next;
+} ExecCacheEntry;
+
+typedef struct Lookahead {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long consumed;   //lines run_loop has read so far
+    int stop;
+    int running;
+} Lookahead;
+
+typedef struct LineReader {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;  //first byte not yet returned
+    size_t end;    //end of buffered input
+    int eof;
+} LineReader;
+
+typedef enum {
+    ARITH_NUM,
+    ARITH_VAR,
+    ARITH_UNARY,
+    ARITH_BINARY,
+    ARITH_JUMP     //short-circuit of && and ||, value is the target op
+} ArithKind;
+
+//binary operators first, in the order they are matched (two characters
+//before one), then the unary ones
+typedef enum {
+    AOP_OR, AOP_AND, AOP_BITOR, AOP_XOR, AOP_BITAND, AOP_EQ, AOP_NE, AOP_LE, AOP_GE,
+    AOP_SHL, AOP_SHR, AOP_LT, AOP_GT, AOP_ADD, AOP_SUB, AOP_MUL, AOP_DIV, AOP_MOD,
+    AOP_NEG, AOP_PLUS, AOP_NOT, AOP_COMPL, AOP_LPAREN
+} ArithOperator;
+
+typedef struct ArithOp {
+    ArithKind kind;
+    int op;        //ArithOperator of unary and binary ops
+    int64_t value; //ARITH_NUM, or the ARITH_JUMP target
+    char *name;    //ARITH_VAR
+} ArithOp;
+
+typedef struct ArithExpr {
+    char *src;
+    ArithOp *ops;  //postfix order
+    int count;
+    int depth;     //evaluation stack needed
+    struct ArithExpr *next;
+} ArithExpr;
+
+typedef struct ReadBuffer {
+    LineReader reader;
+    dev_t dev;     //file the buffered input came from
+    ino_t ino;
+    off_t offset;  //offset read left the fd at
+} ReadBuffer;
+
+typedef struct StateHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;            //whole file, checked against the mapping
+    uint32_t var_count;
+    uint32_t history_count;   //oldest entry first
+    uint32_t history_capacity;
+    uint32_t exec_count;
+    uint64_t vars_offset;     //StateRecord tables
+    uint64_t history_offset;
+    uint64_t exec_offset;
+    uint64_t path_offset;     //PATH the executable cache was built under, 0 if none
+} StateHeader;
+
+typedef struct StateRecord {
+    uint64_t key;    //file offsets of NUL terminated strings
+    uint64_t value;  //unused (0) for history records
+} StateRecord;
+
+typedef struct StateSnapshot {
+    char *base;               //private mapping of the state file
+    size_t size;
+    ShellVariable *vars;      //list nodes for the snapshot's variables
+    size_t var_count;
+    ExecCacheEntry *execs;
+    size_t exec_count;
+} StateSnapshot;
+
+#define MAX_NUMA_NODES 64           //nodes the placement policy keeps track of
+
+typedef struct Topology {
+    int loaded;
+    int cpu_count;                        //cpus this shell may run on
+    int compact[CPU_SETSIZE];             //allowed cpus, node by node
+    int spread[CPU_SETSIZE];              //allowed cpus, alternating nodes
+    int cpu_node[CPU_SETSIZE];
+    int node_count;
+    int used_nodes;                       //nodes with at least one allowed cpu
+    int nodes[MAX_NUMA_NODES];
+    cpu_set_t node_cpus[MAX_NUMA_NODES];
+    long cpu_jobs[CPU_SETSIZE];           //jobs placed on each cpu
+    long node_jobs[MAX_NUMA_NODES];
+    long next;                            //round robin cursor
+} Topology;
+
+typedef struct Placement {
+    cpu_set_t cpus;
+    int node;  //preferred memory node, -1 for none
+} Placement;
+
 //Utilities
 static int compare(const void *a, const void *b);
 static char *trim(char *line);
@@ -59,11 +291,68 @@ static char **parse_line(char *line, int *argc, Redirection *redir);
 //Helper functions
 static RedirectionType get_redirection_type(char *token, int *fd);
 static builtin_cmd_t get_builtin_command(char *cmd);
+static int is_input_redirection(RedirectionType type);
+static char *lookup_var(const char *name);
+static void read_heredoc(FILE *input_stream, Redirection *redir);
+static int heredoc_fd(const char *data, size_t len);
+static int open_input_redirection(Redirection *redir);
 static int add_to_history(char* command);
 static int set_shell_var(char *name, char *value);
+static int set_shell_var_n(char *name, const char *value, size_t len);
+static int store_shell_var(char *name, const char *value, size_t len);
 static char* get_shell_var(char *name);
+static void free_parsed(ParsedCommand *parsed);
 static void free_history();
+static ParsedCommand *history_parse(int command_num, ParsedCommand *scratch);
+static int replay_history(int command_num);
+static int execute_history_run(char **args, int argc);
 static void free_shell_vars();
+static char *find_executable(const char *name);
+static void writev_all(int fd, struct iovec *iov, int iovcnt);
+static void exec_cache_reset(const char *path_env);
+static void lookahead_start(const char *script_path);
+static void line_reader_init(LineReader *reader, int fd);
+static void snapshot_free(void *p);
+static int save_state(const char *path);
+static int load_state(const char *path);
+static void free_state();
+static int parse_cpulist(const char *list, cpu_set_t *set);
+static int placement_next(Placement *placement);
+static void placement_apply(Placement *placement);
+static int arith_compile(const char *src, ArithExpr *expr);
+static int arith_eval(ArithExpr *expr, int64_t *result);
+static ArithExpr *arith_lookup(const char *src);
+static void arith_free(ArithExpr *expr);
+static void arith_cache_free();
+static char *arith_expand_token(char *token);
+static void arith_emit(ArithExpr *expr, ArithOp op, int *cap);
+static size_t env_size();
+static size_t argv_size(char **args, int argc);
+static size_t arg_limit(const char *path);
+static void buf_append(char **buf, size_t *len, size_t *cap, const char *data, size_t n);
+static unsigned exec_cache_bucket(const char *name);
+static void exec_cache_remove(const char *name);
+static char *line_reader_next(LineReader *reader, size_t *len);
+static void line_reader_free(LineReader *reader);
+static LineReader *read_buffer_get(int fd);
+static void read_buffer_release(int fd);
+static char *read_unbuffered_line(int fd, size_t *len);
+static void read_buffers_free();
+static void lookahead_advance();
+static void lookahead_stop();
+static int mux_init(OutputMux *mux, int tag_lines);
+static int mux_spawn(OutputMux *mux, int id, const char *path, char **args, Redirection *redir);
+static void mux_signal(OutputMux *mux, int sig);
+static int mux_wait(OutputMux *mux, int timeout_ms, int *id, int *status);
+static void mux_free(OutputMux *mux);
+static long long monotonic_ms();
+static int parse_duration_ms(const char *text, int *ms);
+static int deadline_remaining_ms();
+static int command_timeout_ms();
+static int wait_child(pid_t pid, int timeout_ms, int *status);
+static uint64_t cache_key(char **args, const char *path, Redirection *redir);
+static int cache_store(const char *entry, const char *path, char **args);
+static void cache_evict(const char *dir);
 int execute_vars();
 int execute_local(char **args, int argc);
 int execute_export(char **args, int argc);
@@ -71,6 +360,17 @@ int execute_cd(char **args, int argc);
 void execute_exit(int argc);
 int execute_history(char **args, int argc);
 int execute_ls();
+int execute_multi(char **args, int argc);
+static void run_external_prefixed(char **args);
+int execute_timeout(char **args, int argc);
+int execute_cached(char **args, int argc, Redirection *redir);
+int execute_tee(char **args, int argc);
+int execute_parallel(char **args, int argc);
+int execute_pin(char **args, int argc);
+int execute_chunk(char **args, int argc);
+int execute_read(char **args, int argc);
+int execute_memstats(int argc);
+static long resident_kb();
 
 //Main functions
 void execute_external_cmd(char **args, char *command_str, int from_history, Redirection *redir);
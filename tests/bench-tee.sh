@@ -0,0 +1,35 @@
+#! /usr/bin/env bash
+
+# Throughput of the wsh tee builtin against coreutils tee on a multi-GB
+# stream. Both read from a pipe and write to a pipe plus one file, which
+# is the case the builtin handles with tee(2)/splice(2).
+#
+# usage: bench-tee.sh [size in GiB] [output file]
+
+size=${1:-4}
+outfile=${2:-${TMPDIR:-/tmp}/wsh-bench-tee.out}
+wsh="$(dirname "$0")/../solution/wsh"
+script=$(mktemp)
+trap 'rm -f "$script" "$outfile"' EXIT
+
+if [[ ! -x $wsh ]]; then
+    echo "build wsh first: make -C solution" >&2
+    exit 1
+fi
+echo "tee $outfile" > "$script"
+
+# run_bench name command...
+run_bench () {
+    local name=$1
+    shift
+    local start end
+    start=$(date +%s.%N)
+    head -c "${size}G" /dev/zero | "$@" | cat > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$name" -v s="$start" -v e="$end" -v g="$size" \
+        'BEGIN { printf "%-12s %6.2f s  %6.2f GiB/s\n", n, e - s, g / (e - s) }'
+}
+
+echo "streaming ${size} GiB into $outfile"
+run_bench "coreutils" tee "$outfile"
+run_bench "wsh tee" "$wsh" "$script"
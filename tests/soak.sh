@@ -0,0 +1,49 @@
+#! /usr/bin/env bash
+
+# Runs a long script of builtins, variable and arithmetic expansion and
+# redirections through wsh, sampling memory with the memstats builtin, and
+# fails if resident memory (or, in MEMSTATS builds, live heap bytes) keeps
+# growing once the shell has warmed up.
+#
+# usage: soak.sh [lines] [allowed rss growth in kB]
+
+lines=${1:-1000000}
+slack=${2:-256}
+wsh="$(dirname "$0")/../solution/wsh"
+script=$(mktemp)
+input=$(mktemp)
+trap 'rm -f "$script" "$input"' EXIT
+
+if [[ ! -x $wsh ]]; then
+    echo "build wsh first: make -C solution" >&2
+    exit 1
+fi
+echo "soak input line" > "$input"
+
+# ten checkpoints, each after a tenth of the lines
+awk -v n="$lines" -v input="$input" 'BEGIN {
+    body[0] = "local i=$((i + 1))"
+    body[1] = "local v=$i"
+    body[2] = "local w=$v >/dev/null"
+    body[3] = "read first rest <" input
+    body[4] = "cd /tmp"
+    for (k = 0; k < n; k++) {
+        print body[k % 5]
+        if ((k + 1) % (n / 10) == 0)
+            print "memstats"
+    }
+}' > "$script"
+
+start=$(date +%s.%N)
+"$wsh" "$script" | awk -v slack="$slack" -v start="$start" '
+    /^rss:/ { rss[++samples] = $2; next }
+    / bytes in / { heap[samples] += $2; tracked = 1 }
+    END {
+        "date +%s.%N" | getline now
+        printf "%d samples in %.1f s, rss %d kB -> %d kB", samples, now - start, rss[2], rss[samples]
+        if (tracked) printf ", live heap %d -> %d bytes", heap[2], heap[samples]
+        printf "\n"
+        if (samples < 3) { print "soak: too few samples"; exit 1 }
+        if (rss[samples] - rss[2] > slack) { print "soak: resident memory grew"; exit 1 }
+        if (tracked && heap[samples] - heap[2] > slack * 1024) { print "soak: live heap grew"; exit 1 }
+    }'
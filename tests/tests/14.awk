@@ -0,0 +1,20 @@
+# order independent view of test 14: the jobs run at once, so lines of
+# different jobs may interleave, but each job's lines must stay whole and in
+# order. Tagged lines are grouped by job; numbers must count up from 1.
+/^\[[0-9]+\] [0-9]+$/ {
+    job = substr($1, 2) + 0
+    if ($2 != ++count[job]) bad[job] = 1
+    if (job > counted) counted = job
+    next
+}
+/^\[[0-9]+\] / { job = substr($1, 2) + 0; lines[job] = lines[job] $0 "\n"; if (job > jobs) jobs = job; next }
+{ plain[n++] = $0 }
+END {
+    for (j = 1; j <= jobs; j++) printf "%s", lines[j]
+    for (j = 1; j <= counted; j++) print "[" j "]", count[j], (bad[j] ? "out of order" : "in order")
+    # untagged jobs have nothing to group by, so only check the lines are whole
+    for (i = 0; i < n; i++) for (k = i; k > 0 && plain[k - 1] > plain[k]; k--) {
+        t = plain[k]; plain[k] = plain[k - 1]; plain[k - 1] = t
+    }
+    for (i = 0; i < n; i++) print plain[i]
+}
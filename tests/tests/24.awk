@@ -0,0 +1,7 @@
+# host independent view of test 24: placed commands must see exactly one
+# allowed cpu, and the per-node counters must add up to the five placed jobs
+/^Cpus_allowed_list:/ { print ($2 ~ /^[0-9]+$/ ? "one cpu" : "cpus " $2); next }
+/^cpu [0-9]+: / { cpu_lines++; next }
+/^node [0-9]+: / { node_jobs += $3; next }
+{ print }
+END { print "cpu counters: " (cpu_lines > 0 ? "yes" : "no"); print "node jobs: " node_jobs }